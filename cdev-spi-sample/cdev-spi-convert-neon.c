@@ -0,0 +1,88 @@
+/*
+ * NEON inner loops of the sample conversion. Built with the FP/SIMD
+ * registers allowed, see the Makefile; only call them between
+ * kernel_neon_begin() and kernel_neon_end().
+ */
+#include <linux/types.h>
+
+#include "cdev-spi-convert.h"
+
+#ifdef CDEV_SPI_CONVERT_NEON
+#include <asm/neon-intrinsics.h>
+
+void cdev_spi_swab16_neon(u8 *buf, size_t blocks) {
+        for (; blocks; blocks--, buf += 16)
+                vst1q_u8(buf, vrev16q_u8(vld1q_u8(buf)));
+}
+
+void cdev_spi_swab32_neon(u8 *buf, size_t blocks) {
+        for (; blocks; blocks--, buf += 16)
+                vst1q_u8(buf, vrev32q_u8(vld1q_u8(buf)));
+}
+
+void cdev_spi_unpack24_neon(u8 *buf, size_t first, size_t count, u32 flags) {
+        size_t b;
+        uint8x16x3_t in;
+        uint8x16x4_t out;
+        bool le = flags & CDEV_SPI_CONV_LE;
+
+        for (b = first + count; b-- > first;) {
+                in = vld3q_u8(buf + 48 * b);
+                out.val[0] = le ? in.val[0] : in.val[2];
+                out.val[1] = in.val[1];
+                out.val[2] = le ? in.val[2] : in.val[0];
+                if (flags & CDEV_SPI_CONV_SIGNED)
+                        out.val[3] = vreinterpretq_u8_s8(
+                                vshrq_n_s8(vreinterpretq_s8_u8(out.val[2]), 7));
+                else
+                        out.val[3] = vdupq_n_u8(0);
+                vst4q_u8(buf + 64 * b, out);
+        }
+}
+
+/**
+ * @brief Unpack 8 sample pairs from the bytes of each unit, p0 p1 p2
+ */
+static inline uint16x8x2_t cdev_spi_unpack12_half(uint8x8_t p0, uint8x8_t p1,
+                                                  uint8x8_t p2, u32 flags) {
+        uint16x8x2_t out;
+        uint16x8_t w0 = vmovl_u8(p0);
+        uint16x8_t w1 = vmovl_u8(p1);
+        uint16x8_t w2 = vmovl_u8(p2);
+        uint16x8_t lo = vandq_u16(w1, vdupq_n_u16(0xf));
+        uint16x8_t hi = vshrq_n_u16(w1, 4);
+
+        if (flags & CDEV_SPI_CONV_LE) {
+                out.val[0] = vorrq_u16(w0, vshlq_n_u16(lo, 8));
+                out.val[1] = vorrq_u16(hi, vshlq_n_u16(w2, 4));
+        } else {
+                out.val[0] = vorrq_u16(vshlq_n_u16(w0, 4), hi);
+                out.val[1] = vorrq_u16(vshlq_n_u16(lo, 8), w2);
+        }
+        if (flags & CDEV_SPI_CONV_SIGNED) {
+                out.val[0] = vreinterpretq_u16_s16(vshrq_n_s16(
+                        vreinterpretq_s16_u16(vshlq_n_u16(out.val[0], 4)), 4));
+                out.val[1] = vreinterpretq_u16_s16(vshrq_n_s16(
+                        vreinterpretq_s16_u16(vshlq_n_u16(out.val[1], 4)), 4));
+        }
+        return out;
+}
+
+void cdev_spi_unpack12_neon(u8 *buf, size_t first, size_t count, u32 flags) {
+        size_t b;
+        uint8x16x3_t in;
+        uint16x8x2_t lo, hi;
+
+        for (b = first + count; b-- > first;) {
+                in = vld3q_u8(buf + 48 * b);
+                lo = cdev_spi_unpack12_half(vget_low_u8(in.val[0]),
+                                            vget_low_u8(in.val[1]),
+                                            vget_low_u8(in.val[2]), flags);
+                hi = cdev_spi_unpack12_half(vget_high_u8(in.val[0]),
+                                            vget_high_u8(in.val[1]),
+                                            vget_high_u8(in.val[2]), flags);
+                vst2q_u16((u16 *) (buf + 64 * b), lo);
+                vst2q_u16((u16 *) (buf + 64 * b + 32), hi);
+        }
+}
+#endif
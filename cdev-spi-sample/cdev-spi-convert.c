@@ -0,0 +1,262 @@
+/*
+ * Sample conversion of received frames: byte order, unpacking of packed
+ * 24 and 12 bit samples and decimation. Runs in the CRC work item, on
+ * data still in cache, with NEON on arm64 and plain C elsewhere.
+ */
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/bitops.h>
+#include <linux/swab.h>
+
+#include "cdev-spi-convert.h"
+
+#ifdef CDEV_SPI_CONVERT_NEON
+#include <asm/cpufeature.h>
+#include <asm/neon.h>
+#include <asm/simd.h>
+#endif
+
+/* Blocks per kernel_neon_begin(), which keeps preemption off */
+#define CDEV_SPI_NEON_BLOCKS     256
+
+static const char * const cdev_spi_conv_names[] = {
+        [CDEV_SPI_CONV_NONE] = "none",
+        [CDEV_SPI_CONV_16] = "16",
+        [CDEV_SPI_CONV_32] = "32",
+        [CDEV_SPI_CONV_PACKED24] = "packed24",
+        [CDEV_SPI_CONV_PACKED12] = "packed12",
+};
+
+int cdev_spi_convert_check(const struct cdev_spi_convert *conv) {
+        if (conv->format >= ARRAY_SIZE(cdev_spi_conv_names) ||
+            conv->flags & ~(CDEV_SPI_CONV_LE | CDEV_SPI_CONV_SIGNED) ||
+            (conv->format == CDEV_SPI_CONV_NONE && conv->decimate > 1) ||
+            conv->channels > U16_MAX)
+                return -EINVAL;
+        return 0;
+}
+
+static bool cdev_spi_neon_usable(void) {
+#ifdef CDEV_SPI_CONVERT_NEON
+        return cpu_have_named_feature(ASIMD) && may_use_simd();
+#else
+        return false;
+#endif
+}
+
+/**
+ * @brief Byte swap each 16 or 32 bit sample in place
+ */
+static void cdev_spi_swab(u8 *buf, size_t len, unsigned int size, bool neon) {
+        size_t n;
+        size_t done = 0;
+
+#ifdef CDEV_SPI_CONVERT_NEON
+        for (; neon && len - done >= 16; done += n * 16) {
+                n = min_t(size_t, (len - done) / 16, CDEV_SPI_NEON_BLOCKS);
+                kernel_neon_begin();
+                if (size == sizeof(u16))
+                        cdev_spi_swab16_neon(buf + done, n);
+                else
+                        cdev_spi_swab32_neon(buf + done, n);
+                kernel_neon_end();
+        }
+#endif
+        for (; done < len; done += size)
+                if (size == sizeof(u16))
+                        swab16s((u16 *) (buf + done));
+                else
+                        swab32s((u32 *) (buf + done));
+}
+
+/**
+ * @brief Unpack 24 bit sample i, or 12 bit sample pair i, in place
+ *
+ * Read before write: the 4 bytes out only cover input of this unit and
+ * the ones after it, already done back to front.
+ */
+static void cdev_spi_unpack_one(u8 *buf, size_t i, u32 format, u32 flags) {
+        u32 a, b;
+        const u8 *p = buf + 3 * i;
+
+        if (format == CDEV_SPI_CONV_PACKED24) {
+                if (flags & CDEV_SPI_CONV_LE)
+                        a = p[0] | p[1] << 8 | p[2] << 16;
+                else
+                        a = p[0] << 16 | p[1] << 8 | p[2];
+                if (flags & CDEV_SPI_CONV_SIGNED)
+                        a = sign_extend32(a, 23);
+                ((u32 *) buf)[i] = a;
+                return;
+        }
+
+        if (flags & CDEV_SPI_CONV_LE) {
+                a = p[0] | (p[1] & 0xf) << 8;
+                b = p[1] >> 4 | p[2] << 4;
+        } else {
+                a = p[0] << 4 | p[1] >> 4;
+                b = (p[1] & 0xf) << 8 | p[2];
+        }
+        if (flags & CDEV_SPI_CONV_SIGNED) {
+                a = sign_extend32(a, 11);
+                b = sign_extend32(b, 11);
+        }
+        ((u16 *) buf)[2 * i] = a;
+        ((u16 *) buf)[2 * i + 1] = b;
+}
+
+/**
+ * @brief Unpack n units of 3 bytes to 4 bytes, back to front in place
+ */
+static void cdev_spi_unpack(u8 *buf, size_t n, u32 format, u32 flags,
+                            bool neon) {
+        size_t i;
+        size_t blocks = neon ? n / 16 : 0;
+        size_t count __maybe_unused;
+
+        /* Units above the last whole NEON block first, they are on top */
+        for (i = n; i-- > blocks * 16;)
+                cdev_spi_unpack_one(buf, i, format, flags);
+
+#ifdef CDEV_SPI_CONVERT_NEON
+        while (blocks) {
+                count = min_t(size_t, blocks, CDEV_SPI_NEON_BLOCKS);
+                blocks -= count;
+                kernel_neon_begin();
+                if (format == CDEV_SPI_CONV_PACKED24)
+                        cdev_spi_unpack24_neon(buf, blocks, count, flags);
+                else
+                        cdev_spi_unpack12_neon(buf, blocks, count, flags);
+                kernel_neon_end();
+        }
+#endif
+}
+
+/**
+ * @brief Keep the first of every decimate groups of samples
+ */
+static size_t cdev_spi_decimate(u8 *buf, size_t len, size_t group,
+                                u32 decimate) {
+        size_t i;
+        size_t kept = DIV_ROUND_UP(len / group, decimate);
+
+        /* Source is always ahead of the destination by a group or more */
+        for (i = 1; i < kept; i++)
+                memcpy(buf + i * group, buf + i * decimate * group, group);
+        return kept * group;
+}
+
+/**
+ * @brief Convert a frame payload in place
+ *
+ * buf must be 4 byte aligned, with room for CDEV_SPI_CONVERT_SIZE(len)
+ * bytes. bits_per_word is the SPI word size buf was received with: above
+ * 8 the SPI core left CPU order words, not the bytes as sent. Returns the
+ * converted length.
+ */
+size_t cdev_spi_convert(const struct cdev_spi_convert *conv, u8 *buf,
+                        size_t len, unsigned int bits_per_word) {
+        size_t out;
+        size_t sample;
+        size_t word = bits_per_word / 8;
+        bool neon = cdev_spi_neon_usable();
+        /* Only MSB first input on little endian CPUs, or the reverse */
+        bool swap = !!(conv->flags & CDEV_SPI_CONV_LE) ==
+                    IS_ENABLED(CONFIG_CPU_BIG_ENDIAN);
+        /* On big endian CPUs words already are the bytes as sent */
+        bool wire = word > 1 && !IS_ENABLED(CONFIG_CPU_BIG_ENDIAN);
+
+        switch (conv->format) {
+        case CDEV_SPI_CONV_16:
+        case CDEV_SPI_CONV_32:
+                sample = conv->format == CDEV_SPI_CONV_16 ? sizeof(u16) :
+                                                            sizeof(u32);
+                out = len / sample * sample;
+                if (wire && word == sample) {
+                        /* MSB first samples are CPU order words already */
+                        if (conv->flags & CDEV_SPI_CONV_LE)
+                                cdev_spi_swab(buf, out, sample, neon);
+                        break;
+                }
+                if (wire)
+                        cdev_spi_swab(buf, len / word * word, word, neon);
+                if (swap)
+                        cdev_spi_swab(buf, out, sample, neon);
+                break;
+        case CDEV_SPI_CONV_PACKED24:
+        case CDEV_SPI_CONV_PACKED12:
+                /* Back to the bytes as sent, samples straddle words */
+                if (wire)
+                        cdev_spi_swab(buf, len / word * word, word, neon);
+                sample = conv->format == CDEV_SPI_CONV_PACKED24 ? sizeof(u32) :
+                                                                  sizeof(u16);
+                out = len / 3 * 4;
+                cdev_spi_unpack(buf, len / 3, conv->format, conv->flags, neon);
+                break;
+        default:
+                return len;
+        }
+
+        if (conv->decimate > 1)
+                out = cdev_spi_decimate(buf, out,
+                                        sample * max(conv->channels, 1U),
+                                        conv->decimate);
+        return out;
+}
+
+/**
+ * @brief Parse "<format> [le] [signed] [decimate=<n>] [channels=<n>]"
+ *
+ * buf is modified. For the convert attribute in sysfs.
+ */
+int cdev_spi_convert_parse(struct cdev_spi_convert *conv, char *buf) {
+        int i;
+        int retval = 0;
+        char *tok;
+
+        *conv = (struct cdev_spi_convert) {};
+        tok = strsep(&buf, " \t\n");
+        i = match_string(cdev_spi_conv_names, ARRAY_SIZE(cdev_spi_conv_names),
+                         tok);
+        if (i < 0)
+                return -EINVAL;
+        conv->format = i;
+
+        while (!retval && (tok = strsep(&buf, " \t\n"))) {
+                if (!*tok)
+                        continue;
+                if (!strcmp(tok, "le"))
+                        conv->flags |= CDEV_SPI_CONV_LE;
+                else if (!strcmp(tok, "signed"))
+                        conv->flags |= CDEV_SPI_CONV_SIGNED;
+                else if (str_has_prefix(tok, "decimate="))
+                        retval = kstrtou32(tok + strlen("decimate="), 0,
+                                           &conv->decimate);
+                else if (str_has_prefix(tok, "channels="))
+                        retval = kstrtou32(tok + strlen("channels="), 0,
+                                           &conv->channels);
+                else
+                        retval = -EINVAL;
+        }
+        if (retval)
+                return retval;
+        return cdev_spi_convert_check(conv);
+}
+
+ssize_t cdev_spi_convert_show(const struct cdev_spi_convert *conv, char *buf) {
+        ssize_t len;
+
+        len = sysfs_emit(buf, "%s", cdev_spi_conv_names[conv->format]);
+        if (conv->flags & CDEV_SPI_CONV_LE)
+                len += sysfs_emit_at(buf, len, " le");
+        if (conv->flags & CDEV_SPI_CONV_SIGNED)
+                len += sysfs_emit_at(buf, len, " signed");
+        if (conv->decimate > 1)
+                len += sysfs_emit_at(buf, len, " decimate=%u", conv->decimate);
+        if (conv->channels > 1)
+                len += sysfs_emit_at(buf, len, " channels=%u", conv->channels);
+        len += sysfs_emit_at(buf, len, "\n");
+        return len;
+}
@@ -0,0 +1,40 @@
+/*
+ * Sample conversion stage of cdev-spi-sample, internal to the module.
+ * The interface to user space is struct cdev_spi_convert in
+ * cdev-spi-sample.h.
+ */
+#ifndef CDEV_SPI_CONVERT_H
+#define CDEV_SPI_CONVERT_H
+
+#include <linux/types.h>
+
+#include "cdev-spi-sample.h"
+
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON) && \
+    !defined(CONFIG_CPU_BIG_ENDIAN)
+#define CDEV_SPI_CONVERT_NEON
+#endif
+
+/* Room len payload bytes need after the largest conversion, unpacking */
+#define CDEV_SPI_CONVERT_SIZE(len)       ((len) / 3 * 4)
+
+int cdev_spi_convert_check(const struct cdev_spi_convert *conv);
+size_t cdev_spi_convert(const struct cdev_spi_convert *conv, u8 *buf,
+                        size_t len, unsigned int bits_per_word);
+int cdev_spi_convert_parse(struct cdev_spi_convert *conv, char *buf);
+ssize_t cdev_spi_convert_show(const struct cdev_spi_convert *conv, char *buf);
+
+#ifdef CDEV_SPI_CONVERT_NEON
+/*
+ * In cdev-spi-convert-neon.c, built with the FP/SIMD registers allowed.
+ * Only between kernel_neon_begin() and kernel_neon_end(). A swab block is
+ * 16 bytes. An unpack block is 16 samples (24 bit) or 16 sample pairs
+ * (12 bit), 48 bytes in and 64 bytes out, done back to front in place.
+ */
+void cdev_spi_swab16_neon(u8 *buf, size_t blocks);
+void cdev_spi_swab32_neon(u8 *buf, size_t blocks);
+void cdev_spi_unpack24_neon(u8 *buf, size_t first, size_t count, u32 flags);
+void cdev_spi_unpack12_neon(u8 *buf, size_t first, size_t count, u32 flags);
+#endif
+
+#endif /* CDEV_SPI_CONVERT_H */
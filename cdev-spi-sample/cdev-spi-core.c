@@ -0,0 +1,3839 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/gpio/consumer.h>
+#include <linux/spi/spi.h>
+#include <linux/interrupt.h>
+#include <linux/of.h>
+#include <linux/err.h>
+#include <linux/crc32.h>
+#include <linux/timekeeping.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/iopoll.h>
+#include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <uapi/linux/sched/types.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/version.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include <linux/string.h>
+#include <linux/swab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/hrtimer.h>
+#include <linux/filter.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+#ifdef CONFIG_ARM64
+#include <asm/cpufeature.h>
+#endif
+
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+
+#include "cdev-spi-sample.h"
+#include "cdev-spi-convert.h"
+
+#define CREATE_TRACE_POINTS
+#include "cdev-spi-trace.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Sample module for SPI driver with char dev");
+
+#define CDEV_SPI_DEVNO_NAME      "cdev_spi"
+#define CDEV_SPI_DEVNO_MINORS    2
+#define CDEV_SPI_MODULE          "cdev-spi-device"
+#define CDEV_SPI_RX_FRAME_SIZE   (10*1024*sizeof(uint32_t) - sizeof(u32))
+#define CDEV_SPI_RX_MAX_FRAME_SIZE (1024*1024)
+#define CDEV_SPI_RX_CRC_SIZE     sizeof(u32)
+#define CDEV_SPI_CLASS           "cdev-spi"
+#define CDEV_SPI_RX_MAX_FRAMES   256
+#define CDEV_SPI_RX_MAX_CHUNKS   64
+#define CDEV_SPI_HIST_BUCKETS    32      /* log2 of ns, last one open ended */
+#define CDEV_SPI_TX_CMDS         16      /* Outbound command queue. Power of 2 */
+#define CDEV_SPI_THROTTLE_POLL_MS 10     /* Tail check while throttled */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+#define kthread_run_worker kthread_create_worker
+#endif
+
+static struct class *cdev_spi_class;
+static dev_t devno;
+static struct drvdata *cdev_spi_devices[CDEV_SPI_DEVNO_MINORS]; /* By minor */
+static LIST_HEAD(cdev_spi_buses);       /* struct cdev_spi_bus by controller */
+static DEFINE_MUTEX(cdev_spi_lock);    /* Protects cdev_spi_devices, _buses */
+static struct dentry *cdev_spi_debugfs;
+static struct workqueue_struct *cdev_spi_retry_wq; /* CRC re-reads, may sleep */
+
+static unsigned int rx_frames = 4;
+module_param(rx_frames, uint, 0444);
+MODULE_PARM_DESC(rx_frames, "Frame buffers per device, queued for the reader. "
+                 "Power of 2, 2 to 256 (default 4)");
+
+static bool rx_async = true;
+module_param(rx_async, bool, 0444);
+MODULE_PARM_DESC(rx_async, "Receive with spi_async() into rotating frame buffers "
+                 "(default true). When false get_block_sync() is used.");
+
+static bool rx_prebuilt = true;
+module_param(rx_prebuilt, bool, 0444);
+MODULE_PARM_DESC(rx_prebuilt, "Build the async SPI messages once at probe and "
+                 "reuse them (default true). When false they are rebuilt per frame.");
+
+static unsigned int rx_frame_size = CDEV_SPI_RX_FRAME_SIZE;
+module_param(rx_frame_size, uint, 0444);
+MODULE_PARM_DESC(rx_frame_size, "Max payload bytes per frame, without the CRC "
+                 "(default 40956). Multiple of 4. The DT property "
+                 "mycomp,max-frame-size overrides it per device");
+
+static bool rx_header = false;
+module_param(rx_header, bool, 0444);
+MODULE_PARM_DESC(rx_header, "Frames start with a struct cdev_spi_frame_hdr "
+                 "giving the payload length (default false). Only the bytes "
+                 "announced are clocked. When false every frame is "
+                 "rx_frame_size bytes");
+
+static unsigned int rx_chunks = 1;
+module_param(rx_chunks, uint, 0444);
+MODULE_PARM_DESC(rx_chunks, "SPI messages per async frame (default 1). With more "
+                 "than one, the CRC is updated as each chunk lands. CS stays "
+                 "asserted between chunks. Not with rx_header");
+
+static unsigned int rx_poll_budget;
+module_param(rx_poll_budget, uint, 0644);
+MODULE_PARM_DESC(rx_poll_budget, "Frames pulled per READY interrupt while READY "
+                 "stays high, before going back to the interrupt (default 0, "
+                 "off)");
+
+static unsigned int rx_poll_us = 100;
+module_param(rx_poll_us, uint, 0644);
+MODULE_PARM_DESC(rx_poll_us, "How long to poll for READY to come back after a "
+                 "frame in polling mode, in us (default 100)");
+
+static unsigned int rx_retries;
+module_param(rx_retries, uint, 0644);
+MODULE_PARM_DESC(rx_retries, "Re-reads of a frame failing CRC, each asking the "
+                 "device with CDEV_SPI_CMD_RETRANSMIT to send it again "
+                 "(default 0, frame is dropped)");
+
+static unsigned int rx_retry_us = 100;
+module_param(rx_retry_us, uint, 0644);
+MODULE_PARM_DESC(rx_retry_us, "Backoff before the first re-read in us, doubled "
+                 "for each further one (default 100)");
+
+static bool rx_retry_slow = true;
+module_param(rx_retry_slow, bool, 0644);
+MODULE_PARM_DESC(rx_retry_slow, "Halve the SPI clock for each re-read "
+                 "(default true)");
+
+static unsigned int bus_depth = 1;
+module_param(bus_depth, uint, 0444);
+MODULE_PARM_DESC(bus_depth, "Async frames in flight per SPI bus (default 1). "
+                 "More keeps the controller queue filled, but lets chunks of "
+                 "frames from different devices interleave");
+
+static bool rx_rt;
+module_param(rx_rt, bool, 0444);
+MODULE_PARM_DESC(rx_rt, "Receive in a dedicated SCHED_FIFO kthread_worker per "
+                 "device instead of the READY IRQ thread (default false). "
+                 "Also on for devices with mycomp,rt or spi-rt in DT");
+
+static unsigned int rx_rt_prio = 50;
+module_param(rx_rt_prio, uint, 0444);
+MODULE_PARM_DESC(rx_rt_prio, "SCHED_FIFO priority of the receive thread with "
+                 "rx_rt, 1 to 99 (default 50). DT mycomp,rt-priority "
+                 "overrides it per device");
+
+static unsigned int rx_bits_per_word;
+module_param(rx_bits_per_word, uint, 0444);
+MODULE_PARM_DESC(rx_bits_per_word, "SPI word size of frame transfers, 8, 16 "
+                 "or 32. Wider words land in CPU byte order. Default DT "
+                 "spi-bits-per-word per device, else 8. Falls back to 8 when "
+                 "the controller cannot");
+
+static int rx_cpu = -1;
+module_param(rx_cpu, int, 0444);
+MODULE_PARM_DESC(rx_cpu, "CPU for the READY interrupt and the receive thread "
+                 "(default -1, any). DT mycomp,cpu overrides it per device");
+
+static bool link_train;
+module_param(link_train, bool, 0444);
+MODULE_PARM_DESC(link_train, "Train the SPI clock at probe (default false). "
+                 "Also on for devices with mycomp,link-train in DT. Write 1 "
+                 "to link_train in sysfs to train on demand");
+
+static unsigned int link_train_max_hz;
+module_param(link_train_max_hz, uint, 0644);
+MODULE_PARM_DESC(link_train_max_hz, "Highest SPI clock tried by link training "
+                 "(default 0, the controller maximum)");
+
+static unsigned int link_train_step = 50;
+module_param(link_train_step, uint, 0644);
+MODULE_PARM_DESC(link_train_step, "Clock increase per training step in percent "
+                 "(default 50)");
+
+static unsigned int link_train_frames = 16;
+module_param(link_train_frames, uint, 0644);
+MODULE_PARM_DESC(link_train_frames, "Frames that must pass CRC at a training "
+                 "step (default 16)");
+
+static unsigned int link_train_ms = 5000;
+module_param(link_train_ms, uint, 0644);
+MODULE_PARM_DESC(link_train_ms, "Time for the device to send link_train_frames "
+                 "at a training step, in ms (default 5000)");
+
+static unsigned int link_train_margin = 20;
+module_param(link_train_margin, uint, 0644);
+MODULE_PARM_DESC(link_train_margin, "Safety margin below the fastest clean "
+                 "clock, and clock decrease per step down, in percent "
+                 "(default 20)");
+
+static unsigned int link_err_window = 1000;
+module_param(link_err_window, uint, 0644);
+MODULE_PARM_DESC(link_err_window, "Frames per error rate check at run time "
+                 "(default 1000, 0 off)");
+
+static unsigned int link_err_max = 10;
+module_param(link_err_max, uint, 0644);
+MODULE_PARM_DESC(link_err_max, "Errors in link_err_window frames that step the "
+                 "clock down, never below spi-max-frequency (default 10)");
+
+static unsigned int rx_throttle_high = 75;
+module_param(rx_throttle_high, uint, 0444);
+MODULE_PARM_DESC(rx_throttle_high, "Ring fill in percent of rx_frames that "
+                 "holds BUSY until the reader catches up (default 75, 0 off)");
+
+static unsigned int rx_throttle_low = 25;
+module_param(rx_throttle_low, uint, 0444);
+MODULE_PARM_DESC(rx_throttle_low, "Ring fill in percent of rx_frames that "
+                 "lets BUSY go again (default 25)");
+
+static unsigned int capture_kb = 4096;
+module_param(capture_kb, uint, 0644);
+MODULE_PARM_DESC(capture_kb, "Buffer of the record and replay files in debugfs, "
+                 "KiB (default 4096)");
+
+static unsigned int replay_speed = 100;
+module_param(replay_speed, uint, 0644);
+MODULE_PARM_DESC(replay_speed, "Replay pace in percent of the recorded one "
+                 "(default 100, 0 back to back)");
+
+static char *crc = "be";
+module_param(crc, charp, 0444);
+MODULE_PARM_DESC(crc, "CRC32 variant of the frame trailer: be (default), be-inv, "
+                 "le, le-inv, be0, le0 or stm32");
+
+/**
+ * @brief CRC32 variant used by the device
+ *
+ * All are CRC-32 with polynomial 0x04c11db7, they differ in bit order,
+ * initial value and final xor. stm32 is the STM32 CRC unit fed with 32 bit
+ * words, i.e. crc32_be over each little endian word byte swapped.
+ * crc32_le runs on the CRC32 instructions on arm64 CPUs that have them.
+ */
+struct crc_variant {
+        const char *name;
+        u32 init;
+        u32 xorout;
+        bool le;                         /* Reflected, crc32_le */
+        bool word_swap;                  /* Byte swap each 32 bit word first */
+};
+
+static const struct crc_variant crc_variants[] = {
+        { "be",     ~0, 0,  false, false },
+        { "be-inv", ~0, ~0, false, false },
+        { "le",     ~0, 0,  true,  false },
+        { "le-inv", ~0, ~0, true,  false },
+        { "be0",    0,  0,  false, false },
+        { "le0",    0,  0,  true,  false },
+        { "stm32",  ~0, 0,  false, true },
+};
+static const struct crc_variant *crc_variant;
+
+struct drvdata;
+
+struct rx_frame;
+
+/**
+ * @brief Latency histogram. Bucket n counts values below 2^n ns
+ */
+struct cdev_spi_hist {
+        unsigned long bucket[CDEV_SPI_HIST_BUCKETS];
+};
+
+/**
+ * @brief One async SPI message filling a part of a frame buffer
+ */
+struct rx_chunk {
+        struct rx_frame *frame;
+        unsigned int index;
+        struct spi_message msg;
+        struct spi_transfer xfer;
+};
+
+/**
+ * @brief One receive frame buffer and the SPI messages filling it
+ *
+ * chunks_done is written by the chunk completions and read by rx_work,
+ * which folds finished chunks into the running crc while the rest of the
+ * frame is still on the wire. It counts the chunks done from chunk 0 on
+ * without a gap.
+ */
+struct rx_frame {
+        struct drvdata *drvdata;         /* Owning device */
+        u8 *rx_data;                     /* Slot in the shared ring */
+        int status;                      /* Result of the SPI transfer */
+        bool valid;                      /* Transfer and CRC ok */
+        struct rx_chunk *chunks;         /* rx_chunks entries */
+        atomic_t pending;                /* Chunk messages not completed */
+        unsigned int chunks_done;
+        u32 crc;                         /* Running CRC over crc_len bytes */
+        size_t crc_len;
+        unsigned int seq;                /* Frame number, rx_submit at claim */
+        u64 irq_ns;                      /* READY interrupt */
+        u64 start_ns;                    /* SPI transfer submitted */
+        u64 end_ns;                      /* SPI transfer completed */
+        unsigned int len;                /* Payload bytes of this frame */
+        struct cdev_spi_frame_hdr *hdr;  /* rx_header: header from the device */
+        struct spi_message hdr_msg;
+        struct spi_transfer hdr_xfer;
+        struct cdev_spi_cmd *cmd;        /* Sent on MOSI at frame start */
+        struct spi_transfer cmd_xfer;    /* Without rx_header: ahead of chunk 0 */
+};
+
+/**
+ * @brief Devices sharing one SPI controller and its BUSY line
+ *
+ * users is protected by cdev_spi_lock, everything else by lock.
+ */
+struct cdev_spi_bus {
+        struct list_head node;           /* In cdev_spi_buses */
+        struct spi_controller *ctlr;
+        unsigned int users;
+        struct gpio_desc *busy;          /* Output. Raised while any is busy */
+        struct drvdata *busy_owner;      /* BUSY requested for its device */
+        spinlock_t lock;
+        unsigned int busy_count;         /* Devices with frames claimed */
+        unsigned int inflight;           /* Frames submitted to the SPI core */
+        bool kicking;                    /* A caller is submitting frames */
+        unsigned int paused;             /* No new frames while non zero */
+        wait_queue_head_t idle;          /* Woken when nothing is in flight */
+        struct list_head devices;        /* Round robin order */
+};
+
+/**
+ * @brief Structure for holding device state across driver callbacks
+ *
+ * Frames rotate through frames[] by free running counters:
+ * rx_submit (frames claimed on a READY edge), rx_start (frames handed to
+ * the SPI core by the bus), rx_done (frames completed by the controller),
+ * rx_retired (completions fully returned), rx_head (frames checked by
+ * rx_work and queued for the reader) and the ring tail (frames consumed by
+ * the reader).
+ * rx_submit, rx_done and rx_retired are protected by rx_lock, rx_start by
+ * the bus lock. rx_head and the tail form a single producer/single
+ * consumer queue: rx_head is only written by rx_work and mirrored to
+ * ring->head, the tail only by the consumer.
+ *
+ * Frame data lives in the ring that user space can mmap(), so the SPI
+ * controller writes straight into the slot the consumer reads. Since the
+ * tail is in user memory it is only used through rx_tail_get().
+ * Readers in the driver (read(), RECV_BATCH, splice()) consume at the
+ * tail like a mmap reader.
+ *
+ * Lifetime is reference counted, so an open file or a mapping keeps the
+ * frames alive after the SPI device is removed.
+ */
+struct drvdata {
+        struct spi_device *spidev;
+        struct kref kref;
+        int irq;                         /* IRQ for ready pin */
+        struct gpio_desc *ready;         /* Input. Raised when data is ready */
+        struct cdev_spi_bus *bus;        /* Shared BUSY and bus scheduling */
+        struct list_head bus_node;       /* In bus->devices */
+        u32 priority;                    /* mycomp,priority, higher first */
+        struct rx_frame *frames;         /* rx_frames entries */
+        unsigned int frame_size;         /* Max payload bytes per frame */
+        size_t slot_size;                /* Payload and CRC or converted, page aligned */
+        struct cdev_spi_ring *ring;      /* Header pages, then the slots */
+        size_t ring_size;
+        size_t data_offset;              /* Slot 0 in ring, kept from user space */
+        unsigned int rx_mask;            /* rx_frames - 1 */
+        spinlock_t rx_lock;
+        unsigned int rx_submit;
+        unsigned int rx_start;
+        unsigned int rx_done;
+        unsigned int rx_retired;
+        unsigned int rx_head;
+        size_t splice_off;               /* Into the frame at the tail, read_lock */
+        struct cdev_spi_convert conv;    /* Protected by rx_lock */
+        struct cdev_spi_filter filter;   /* Protected by rx_lock */
+        struct bpf_prog *filter_prog;    /* rx_lock, freed after rx_work ran */
+        unsigned int filter_prog_end;    /* rx_lock, end of its last load */
+        u32 filter_crc;                  /* Frame before, for DROP_REPEAT */
+        unsigned int filter_len;
+        struct work_struct rx_work;      /* CRC check of completed frames */
+        struct work_struct retry_work;   /* Re-read of the frame at rx_head */
+        bool retrying;                   /* rx_lock, retry_work owns the device */
+        bool retry_done;                 /* rx_work only, retry_work set valid */
+        wait_queue_head_t rx_idle;       /* Woken when no frame is in flight */
+        wait_queue_head_t rx_wait;       /* Woken when frames are queued */
+        struct mutex read_lock;          /* Serializes readers */
+        DECLARE_KFIFO(tx_fifo, struct cdev_spi_cmd, CDEV_SPI_TX_CMDS);
+        spinlock_t tx_lock;              /* Protects tx_fifo */
+        wait_queue_head_t tx_wait;       /* Woken when tx_fifo has room */
+        bool removed;                    /* SPI device is gone */
+        int cpu;                         /* READY IRQ and rx thread, or -1 */
+        struct kthread_worker *rx_worker; /* rx_rt: receives instead of the IRQ thread */
+        struct kthread_work rx_ready_work;
+        u64 irq_ns;                      /* Last READY edge, from the top half */
+        u32 speed_hz;                    /* SPI clock of all frame transfers */
+        u32 bits_per_word;               /* Of the frame transfers */
+        u8 rx_nbits;                     /* Data lines of receive only transfers */
+        struct mutex speed_lock;         /* Serializes speed changes */
+        struct work_struct train_work;   /* Link training */
+        struct work_struct slow_work;    /* Step the clock down */
+        bool training;
+        bool train_cancel;               /* Set by remove() */
+        int train_result;                /* Of the last training, 0 if ok */
+        unsigned int link_head;          /* rx_head at start of error window */
+        unsigned long link_errors;       /* Error count at start of window */
+        unsigned int throttle_high;      /* Frames in the ring that throttle */
+        unsigned int throttle_low;       /* Frames in the ring that end it */
+        bool throttled;                  /* Holding BUSY for the reader */
+        u64 throttle_start_ns;
+        struct delayed_work throttle_work; /* Tail check for mmap readers */
+        struct dentry *debugfs;
+        /* Record and replay, see struct cdev_spi_capture */
+        struct mutex capture_lock;       /* Start and stop of both */
+        bool capture_stop;               /* Set by remove() */
+        bool recording;                  /* rx_work adds to record_fifo */
+        u8 *record_buf;
+        struct kfifo record_fifo;
+        wait_queue_head_t record_wait;   /* Woken when records are added */
+        bool replaying;                  /* READY and the bus left alone */
+        bool replay_eof;                 /* Writer gone, play out the rest */
+        bool replay_done;
+        u8 *replay_buf;
+        struct kfifo replay_fifo;        /* Written to the replay file */
+        wait_queue_head_t replay_wait;   /* Room, records and replay_done */
+        struct cdev_spi_capture *replay_rec; /* Record being replayed */
+        struct task_struct *replay_task;
+        /* Statistics */
+        unsigned long rx_frames;         /* Frames received with valid CRC */
+        unsigned long rx_bytes;          /* Payload bytes of those frames */
+        unsigned long crc_errors;        /* Including failed re-reads */
+        unsigned long rx_recovered;      /* Frames ok after re-reads */
+        unsigned long rx_lost;           /* Still bad after rx_retries, or too late */
+        unsigned long spi_errors;
+        unsigned long hdr_errors;        /* rx_header: bad frame header */
+        unsigned long seq_gaps;          /* rx_header: frames lost on device */
+        u16 hdr_seq;                     /* Expected next header seq */
+        unsigned long missed_edges;      /* READY edges with no free buffer */
+        unsigned long dropped_seen;      /* missed_edges + seq_gaps at last slot */
+        unsigned long tx_cmds;           /* Commands sent to the device */
+        unsigned long irqs;              /* READY interrupts handled */
+        unsigned long polled_frames;     /* Frames taken without an interrupt */
+        unsigned long poll_budget_hits;  /* Polling stopped by rx_poll_budget */
+        unsigned long link_slowdowns;    /* Clock stepped down at run time */
+        unsigned long throttles;         /* BUSY held for the reader */
+        u64 throttle_ns;                 /* Time throttled, ended periods */
+        unsigned long throttle_saved;    /* Frames taken while throttled */
+        unsigned long throttle_drops;    /* READY edges lost while throttled */
+        unsigned long filtered;          /* Frames dropped by the filter */
+        unsigned long record_drops;      /* Frames the record file had no room for */
+        unsigned long replay_frames;     /* Frames taken from the replay file */
+        unsigned long replay_errors;     /* Replay input discarded as corrupt */
+        u64 setup_ns;                    /* Message setup + spi_async() time */
+        u64 setup_ns_max;
+        unsigned long setup_count;
+        struct cdev_spi_hist hist_start; /* READY IRQ to SPI start */
+        struct cdev_spi_hist hist_xfer;  /* SPI start to completion */
+        struct cdev_spi_hist hist_crc;   /* CRC check after completion */
+        int minor;
+        struct cdev *chardev;
+};
+
+
+#define DEV_DEBUG       dev_info
+// #define DEBUG_DUMP_SPI // DUMP SPI device on succesful probe
+// #define DEBUG_DUMP_CRC // DUMP data and CRC32 alternatives on each received
+                          // packet from SPI slave. Used for getting the right 
+                          // CRC32 from STM32F4 - which is challenging.
+
+/**
+ * Forward declarations
+*/
+static int get_block_sync(struct drvdata *drvdata, size_t n, u8 *buf);
+static int get_frame_sync(struct rx_frame *frame);
+static void rx_ready(struct drvdata *drvdata);
+static irqreturn_t top_ready_handler(int irq, void *dev_id);
+static irqreturn_t bottom_ready_handler(int irq, void *dev_id);
+static struct rx_frame *rx_frame_get(struct drvdata *drvdata);
+static void rx_frame_prepare(struct rx_frame *frame);
+static int rx_frame_hdr_parse(struct rx_frame *frame);
+static void get_block_async(struct rx_frame *frame);
+static void rx_chunk_complete(void *context);
+static void rx_hdr_complete(void *context);
+static void rx_frame_complete(struct rx_frame *frame);
+static void rx_work_handler(struct work_struct *work);
+static bool rx_quiesced(struct drvdata *drvdata);
+static void cdev_spi_bus_kick(struct cdev_spi_bus *bus);
+static void cdev_spi_bus_done(struct cdev_spi_bus *bus);
+static void cdev_spi_bus_busy_get(struct cdev_spi_bus *bus);
+static void cdev_spi_bus_busy_put(struct cdev_spi_bus *bus);
+static int module_probe(struct spi_device *spidev);
+static void module_remove(struct spi_device *spidev);
+static int __init spi_module_init(void);
+static void __exit spi_module_exit(void);
+
+/**
+ * @brief Dump spi device info for debug
+*/
+#ifdef DEBUG_DUMP_SPI
+static void dump_spi_device(struct spi_device *spidev) {
+        DEV_DEBUG(&spidev->dev, "SPI device dump\n");
+        DEV_DEBUG(&spidev->dev, "===============\n");
+        DEV_DEBUG(&spidev->dev, "max_speed_hz: %d\n", spidev->max_speed_hz);
+        DEV_DEBUG(&spidev->dev, "chip_select: %d\n", spidev->chip_select);
+        DEV_DEBUG(&spidev->dev, "bits_per_word: %d\n", spidev->bits_per_word);
+        DEV_DEBUG(&spidev->dev, "rt: %d\n", spidev->rt);
+        DEV_DEBUG(&spidev->dev, "mode: 0x%x\n", spidev->mode);
+        DEV_DEBUG(&spidev->dev, "irq: %d\n", spidev->irq);
+        DEV_DEBUG(&spidev->dev, "===============\n");
+}
+#define DEBUG_DUMP_SPI_DEVICE(dev) dump_spi_device(dev)
+#else
+#define DEBUG_DUMP_SPI_DEVICE(dev) 
+#endif
+
+/**
+ * @brief Between wire byte order and SPI words in CPU byte order
+ *
+ * With 16 or 32 bits per word the controller stores each word received
+ * MSB first as a CPU word, and sends CPU words MSB first. On little
+ * endian CPUs that swaps the bytes of each word. Its own inverse.
+ */
+static void cdev_spi_swab_words(void *buf, size_t len,
+                                unsigned int bits_per_word) {
+        size_t i;
+
+        if (bits_per_word == 16)
+                for (i = 0; i < len / sizeof(u16); i++)
+                        cpu_to_be16s((u16 *) buf + i);
+        else if (bits_per_word == 32)
+                for (i = 0; i < len / sizeof(u32); i++)
+                        cpu_to_be32s((u32 *) buf + i);
+}
+
+/**
+ * @brief Continue a CRC over len bytes. len is a multiple of 4 for stm32
+ *
+ * The CRC is over the bytes in wire order, whatever the SPI word size.
+ */
+static u32 crc_update(const struct crc_variant *variant,
+                      unsigned int bits_per_word, u32 crc,
+                      const u8 *buf, size_t len) {
+        size_t i, n;
+        u32 words[16];
+        bool wire = bits_per_word > 8 && !IS_ENABLED(CONFIG_CPU_BIG_ENDIAN);
+
+        if (!wire && !variant->word_swap)
+                return variant->le ? crc32_le(crc, buf, len) :
+                                     crc32_be(crc, buf, len);
+
+        for (; len; buf += n, len -= n) {
+                n = min(len, sizeof(words));
+                memcpy(words, buf, n);
+                cdev_spi_swab_words(words, n, bits_per_word);
+                if (variant->word_swap)
+                        for (i = 0; i < n / sizeof(u32); i++)
+                                swab32s(&words[i]);
+                crc = variant->le ? crc32_le(crc, (u8 *) words, n) :
+                                    crc32_be(crc, (u8 *) words, n);
+        }
+        return crc;
+}
+
+#ifdef DEBUG_DUMP_CRC
+/**
+ * @brief Dump the frame CRC32 in all supported variants for debug
+*/
+static void dump_crc32(struct device *dev, const u8 *rx_data, size_t len,
+                       unsigned int bits_per_word) {
+        int i;
+        u32 comp_crc;
+        u32 recv_crc;
+
+        memcpy(&recv_crc, &rx_data[len], sizeof(recv_crc));
+        cdev_spi_swab_words(&recv_crc, sizeof(recv_crc), bits_per_word);
+
+        DEV_DEBUG(dev, "Received CRC: 0x%x\n", recv_crc);
+        for (i = 0; i < ARRAY_SIZE(crc_variants); i++) {
+                comp_crc = crc_update(&crc_variants[i], bits_per_word,
+                                crc_variants[i].init, rx_data, len);
+                comp_crc ^= crc_variants[i].xorout;
+                DEV_DEBUG(dev, "%-7s CRC 0x%x%s\n", crc_variants[i].name,
+                                comp_crc, comp_crc == recv_crc ? " <==" : "");
+        }
+
+        DEV_DEBUG(dev, "[%s]\n", rx_data);
+}
+#define DEBUG_DUMP_CRC32(dev, buf, len, bpw) dump_crc32(dev, buf, len, bpw)
+#else
+#define DEBUG_DUMP_CRC32(dev, buf, len, bpw) 
+#endif
+
+/**
+ * @brief Fold the payload of the first chunks of a frame into its CRC
+ */
+static void rx_frame_crc_update(struct rx_frame *frame, unsigned int chunks) {
+        size_t chunk_len = (frame->drvdata->frame_size + CDEV_SPI_RX_CRC_SIZE) /
+                           rx_chunks;
+        size_t end = min_t(size_t, chunks * chunk_len, frame->len);
+
+        if (end <= frame->crc_len)
+                return;
+        frame->crc = crc_update(crc_variant, frame->drvdata->bits_per_word,
+                                frame->crc, frame->rx_data + frame->crc_len,
+                                end - frame->crc_len);
+        frame->crc_len = end;
+}
+
+/**
+ * @brief Check CRC of a received frame and account for it
+ */
+static bool process_frame(struct drvdata *drvdata, struct rx_frame *frame) {
+        u32 recv_crc;
+        u32 comp_crc;
+        struct spi_device *spidev = drvdata->spidev;
+
+        if (frame->status == -EPROTO) {
+                drvdata->hdr_errors++;
+                dev_err_ratelimited(&spidev->dev, "Bad frame header\n");
+                return false;
+        }
+        if (frame->status) {
+                drvdata->spi_errors++;
+                dev_err_ratelimited(&spidev->dev, "SPI transfer failed %d\n",
+                                    frame->status);
+                return false;
+        }
+
+        DEBUG_DUMP_CRC32(&spidev->dev, frame->rx_data, frame->len,
+                         drvdata->bits_per_word);
+        rx_frame_crc_update(frame, rx_chunks);
+        comp_crc = frame->crc ^ crc_variant->xorout;
+        memcpy(&recv_crc, &frame->rx_data[frame->len], sizeof(recv_crc));
+        cdev_spi_swab_words(&recv_crc, sizeof(recv_crc), drvdata->bits_per_word);
+        if (comp_crc != recv_crc) {
+                drvdata->crc_errors++;
+                dev_err_ratelimited(&spidev->dev,
+                        "Error on SPI. Got CRC 0x%x, expected 0x%x\n",
+                        recv_crc, comp_crc);
+                return false;
+        }
+        if (rx_header) {
+                if (drvdata->rx_frames &&
+                    le16_to_cpu(frame->hdr->seq) != drvdata->hdr_seq)
+                        drvdata->seq_gaps += (u16) (le16_to_cpu(frame->hdr->seq) -
+                                                    drvdata->hdr_seq);
+                drvdata->hdr_seq = le16_to_cpu(frame->hdr->seq) + 1;
+        }
+        drvdata->rx_frames++;
+        drvdata->rx_bytes += frame->len;
+        return true;
+}
+
+/**
+ * @brief Count a latency in its log2 bucket
+ *
+ * Updated without locking, like the other statistics.
+ */
+static void cdev_spi_hist_add(struct cdev_spi_hist *hist, u64 ns) {
+        unsigned int n = min_t(unsigned int, fls64(ns), CDEV_SPI_HIST_BUCKETS - 1);
+
+        hist->bucket[n]++;
+}
+
+/**
+ * @brief Timestamp the READY edge in hard IRQ context
+ */
+static irqreturn_t top_ready_handler(int irq, void *dev_id) {
+        struct spi_device *spidev = (struct spi_device *) dev_id;
+        struct drvdata *drvdata = spi_get_drvdata(spidev);
+
+        WRITE_ONCE(drvdata->irq_ns, ktime_get_ns());
+        if (!drvdata->rx_worker)
+                return IRQ_WAKE_THREAD;
+
+        /* Like IRQF_ONESHOT: masked until the worker is done with it */
+        disable_irq_nosync(irq);
+        kthread_queue_work(drvdata->rx_worker, &drvdata->rx_ready_work);
+        return IRQ_HANDLED;
+}
+
+/**
+ * @brief Account for a frame going on the wire
+ */
+static void rx_frame_start(struct rx_frame *frame) {
+        struct drvdata *drvdata = frame->drvdata;
+
+        /* Next queued command goes out in the first bytes, else a NOP */
+        if (kfifo_out_spinlocked(&drvdata->tx_fifo, frame->cmd, 1,
+                                 &drvdata->tx_lock)) {
+                drvdata->tx_cmds++;
+                wake_up_interruptible(&drvdata->tx_wait);
+        } else {
+                memset(frame->cmd, 0, sizeof(struct cdev_spi_cmd));
+        }
+        /* Without rx_header the command goes out in frame words */
+        if (!rx_header)
+                cdev_spi_swab_words(frame->cmd, sizeof(struct cdev_spi_cmd),
+                                    drvdata->bits_per_word);
+
+        frame->start_ns = ktime_get_ns();
+        cdev_spi_hist_add(&drvdata->hist_start, frame->start_ns - frame->irq_ns);
+        trace_cdev_spi_start(drvdata->minor, frame->seq,
+                             frame->start_ns - frame->irq_ns);
+}
+
+/**
+ * @brief Fill a claimed frame from the record being replayed
+ *
+ * Takes the place of the SPI transfer, so the frame goes through the
+ * header check, CRC, conversion and the ring like a received one.
+ */
+static void rx_frame_replay(struct rx_frame *frame) {
+        struct drvdata *drvdata = frame->drvdata;
+        struct cdev_spi_capture *rec = drvdata->replay_rec;
+
+        rx_frame_start(frame);
+        frame->status = rec->status;
+        if (!frame->status && rx_header) {
+                *frame->hdr = rec->hdr;
+                if (rx_frame_hdr_parse(frame) < 0)
+                        frame->status = -EPROTO;
+        }
+        if (!frame->status)
+                memcpy(frame->rx_data, rec + 1,
+                       min_t(size_t, rec->len,
+                             frame->len + CDEV_SPI_RX_CRC_SIZE));
+        drvdata->replay_frames++;
+        rx_frame_complete(frame);
+}
+
+/**
+ * @brief Receive a claimed frame in the configured mode
+ */
+static void rx_frame_receive(struct rx_frame *frame) {
+        if (READ_ONCE(frame->drvdata->replaying)) {
+                rx_frame_replay(frame);
+                return;
+        }
+        if (rx_async) {
+                cdev_spi_bus_kick(frame->drvdata->bus);
+                return;
+        }
+
+        /* Not while the device is asked for the frame before again */
+        wait_event(frame->drvdata->rx_idle,
+                   !READ_ONCE(frame->drvdata->retrying));
+        rx_frame_start(frame);
+        frame->status = get_frame_sync(frame);
+        rx_frame_complete(frame);
+}
+
+/**
+ * @brief Keep pulling frames while READY stays up, NAPI style
+ *
+ * Runs in the READY thread with the interrupt still masked (IRQF_ONESHOT,
+ * or disabled until the rx_rt worker is done).
+ * After each frame READY is polled for up to rx_poll_us. At most
+ * rx_poll_budget frames are taken this way before going back to the
+ * interrupt, so a busy device cannot keep the thread forever. An edge
+ * while masked is still latched and raises the interrupt on unmask.
+ */
+static void rx_poll(struct drvdata *drvdata) {
+        int level;
+        unsigned int budget;
+        struct rx_frame *frame;
+
+        for (budget = READ_ONCE(rx_poll_budget); budget; budget--) {
+                /* Let the frame finish, READY is only meaningful after it */
+                if (!wait_event_timeout(drvdata->rx_idle, rx_quiesced(drvdata),
+                                        HZ))
+                        return;
+                if (read_poll_timeout(gpiod_get_value_cansleep, level,
+                                      level > 0, 0, READ_ONCE(rx_poll_us),
+                                      false, drvdata->ready))
+                        return;
+
+                WRITE_ONCE(drvdata->irq_ns, ktime_get_ns());
+                frame = rx_frame_get(drvdata);
+                if (!frame)
+                        return;
+                drvdata->polled_frames++;
+                rx_frame_receive(frame);
+        }
+        drvdata->poll_budget_hits++;
+}
+
+/**
+ * @brief Take a READY edge, in the IRQ thread or the rx_rt worker
+ *
+ * In async mode the frame is only claimed here and started by the bus
+ * when it has room, so the thread returns (and the READY IRQ is unmasked)
+ * while the frame is still queued or on the wire, unless rx_poll_budget
+ * keeps it polling for the next frames.
+ * Nothing is logged per frame; see the cdev_spi tracepoints instead.
+ */
+static void rx_ready(struct drvdata *drvdata) {
+        struct rx_frame *frame;
+
+        drvdata->irqs++;
+        if (trace_cdev_spi_ready_enabled())
+                trace_cdev_spi_ready(drvdata->minor,
+                                     gpiod_get_value(drvdata->ready));
+
+        frame = rx_frame_get(drvdata);
+        if (!frame)
+                return;
+
+        rx_frame_receive(frame);
+        if (!READ_ONCE(drvdata->replaying))
+                rx_poll(drvdata);
+}
+
+/**
+ * @brief Handle interrupt in bottom half (in another thread)
+ */
+static irqreturn_t bottom_ready_handler(int irq, void *dev_id) {
+        struct spi_device *spidev = (struct spi_device *) dev_id;
+
+        rx_ready(spi_get_drvdata(spidev));
+        return IRQ_HANDLED;
+}
+
+static void rx_ready_work_fn(struct kthread_work *work) {
+        struct drvdata *drvdata = container_of(work, struct drvdata,
+                                               rx_ready_work);
+
+        rx_ready(drvdata);
+        enable_irq(drvdata->irq);
+}
+
+/**
+ * @brief devm action. Runs after remove(), with the IRQ already freed
+ */
+static void rx_rt_release(void *data) {
+        struct drvdata *drvdata = data;
+
+        kthread_destroy_worker(drvdata->rx_worker);
+}
+
+/**
+ * @brief Set up where and how READY edges are handled
+ *
+ * With rx_rt (or mycomp,rt or spi-rt on the device) a kthread_worker at
+ * SCHED_FIFO rx_rt_prio takes the edges instead of the IRQ thread, and
+ * spi->rt makes the SPI core run its message pump at SCHED_FIFO as well.
+ * With a CPU set, the worker is bound to it and the READY interrupt is
+ * steered to it; without rx_rt the IRQ thread follows the interrupt.
+ * Called before spi_setup(), which picks up spi->rt.
+ */
+static int rx_rt_setup(struct drvdata *drvdata) {
+        struct spi_device *spidev = drvdata->spidev;
+        struct device_node *np = spidev->dev.of_node;
+        u32 prio = rx_rt_prio;
+        u32 cpu;
+        struct sched_attr attr = {
+                .size = sizeof(attr),
+                .sched_policy = SCHED_FIFO,
+        };
+        int retval;
+
+        drvdata->cpu = rx_cpu;
+        if (!of_property_read_u32(np, "mycomp,cpu", &cpu))
+                drvdata->cpu = cpu;
+        if (drvdata->cpu >= 0 && ((unsigned int) drvdata->cpu >= nr_cpu_ids ||
+                                  !cpu_online(drvdata->cpu))) {
+                dev_err(&spidev->dev, "CPU %d not online\n", drvdata->cpu);
+                return -EINVAL;
+        }
+
+        if (!rx_rt && !of_property_read_bool(np, "mycomp,rt") && !spidev->rt)
+                return 0;
+
+        of_property_read_u32(np, "mycomp,rt-priority", &prio);
+        if (!prio || prio >= MAX_RT_PRIO) {
+                dev_err(&spidev->dev, "RT priority %u not in 1 to %d\n",
+                        prio, MAX_RT_PRIO - 1);
+                return -EINVAL;
+        }
+
+        drvdata->rx_worker = kthread_run_worker(0, "cdev_spi/%s",
+                                                dev_name(&spidev->dev));
+        if (IS_ERR(drvdata->rx_worker)) {
+                retval = PTR_ERR(drvdata->rx_worker);
+                drvdata->rx_worker = NULL;
+                return retval;
+        }
+        kthread_init_work(&drvdata->rx_ready_work, rx_ready_work_fn);
+        retval = devm_add_action_or_reset(&spidev->dev, rx_rt_release,
+                                          drvdata);
+        if (retval)
+                return retval;
+
+        attr.sched_priority = prio;
+        retval = sched_setattr_nocheck(drvdata->rx_worker->task, &attr);
+        if (retval)
+                return retval;
+        if (drvdata->cpu >= 0) {
+                retval = set_cpus_allowed_ptr(drvdata->rx_worker->task,
+                                              cpumask_of(drvdata->cpu));
+                if (retval)
+                        return retval;
+        }
+
+        spidev->rt = true;
+        dev_info(&spidev->dev, "receiving at SCHED_FIFO %u on CPU %d\n", prio,
+                 drvdata->cpu);
+        return 0;
+}
+
+/**
+ * @brief Check the frame header and take the payload length from it
+ */
+static int rx_frame_hdr_parse(struct rx_frame *frame) {
+        u32 len = le32_to_cpu(frame->hdr->len);
+
+        if (frame->hdr->magic != CDEV_SPI_HDR_MAGIC ||
+            len > frame->drvdata->frame_size ||
+            len % (frame->drvdata->bits_per_word / 8))
+                return -EPROTO;
+        frame->len = len;
+        return len;
+}
+
+/**
+ * @brief Get a frame in synchronous mode
+ *
+ * The command goes out with the header, or with the first bytes of the
+ * frame without rx_header. With rx_header the header transfer keeps CS
+ * asserted for the payload. After a bad header an empty transfer releases
+ * CS again.
+ */
+static int get_frame_sync(struct rx_frame *frame) {
+        int len;
+        int retval;
+        struct spi_message msg;
+        struct drvdata *drvdata = frame->drvdata;
+        struct spi_device *spidev = drvdata->spidev;
+        struct spi_transfer t[2] = {
+                {
+                        .speed_hz = drvdata->speed_hz,
+                        .bits_per_word = rx_header ? 8 : drvdata->bits_per_word,
+                        .tx_buf = frame->cmd,
+                        .rx_buf = rx_header ? (void *) frame->hdr :
+                                              frame->rx_data,
+                        .len = rx_header ? sizeof(struct cdev_spi_frame_hdr) :
+                                           sizeof(struct cdev_spi_cmd),
+                        .cs_change = rx_header
+                }, {
+                        .speed_hz = drvdata->speed_hz,
+                        .bits_per_word = drvdata->bits_per_word,
+                        .rx_nbits = drvdata->rx_nbits,
+                        .rx_buf = frame->rx_data + sizeof(struct cdev_spi_cmd),
+                        .len = frame->len + CDEV_SPI_RX_CRC_SIZE -
+                               sizeof(struct cdev_spi_cmd)
+                }
+        };
+
+        if (!rx_header) {
+                spi_message_init_with_transfers(&msg, t, 2);
+                return spi_sync(spidev, &msg);
+        }
+
+        spi_message_init_with_transfers(&msg, t, 1);
+        len = spi_sync(spidev, &msg);
+        if (!len)
+                len = rx_frame_hdr_parse(frame);
+
+        retval = get_block_sync(drvdata,
+                                len < 0 ? 0 : len + CDEV_SPI_RX_CRC_SIZE,
+                                frame->rx_data);
+        return len < 0 ? len : retval;
+}
+
+/**
+ * @brief Get block of data in synchronous mode
+*/
+static int get_block_sync(struct drvdata *drvdata, size_t n, u8 *buf) {
+        int retval;
+        struct spi_message msg;
+        struct spi_transfer t = {
+                .speed_hz = drvdata->speed_hz,
+                .bits_per_word = drvdata->bits_per_word,
+                .rx_nbits = drvdata->rx_nbits,
+                .rx_buf = buf,
+                .len = n
+        };
+
+        spi_message_init(&msg);
+        spi_message_add_tail(&t, &msg);
+
+        retval = spi_sync(drvdata->spidev, &msg);
+
+        return retval;
+}
+
+/**
+ * @brief Consumer position in the ring, sanitized
+ *
+ * User space may write anything to ring->tail. A tail outside the frames
+ * queued for the reader is taken as "all consumed", which never hands out
+ * a slot that is still in flight or being checked.
+ */
+static unsigned int rx_tail_get(struct drvdata *drvdata) {
+        unsigned int head = READ_ONCE(drvdata->rx_head);
+        unsigned int tail = smp_load_acquire(&drvdata->ring->tail);
+
+        if (head - tail > drvdata->rx_mask + 1)
+                return head;
+        return tail;
+}
+
+/**
+ * @brief Hold BUSY while the reader is behind. Called with rx_lock held
+ *
+ * The fill is every frame not yet handed back by the reader: claimed, in
+ * flight, being checked or queued. Reaching throttle_high takes a BUSY
+ * reference, so the device holds off instead of its frames being dropped
+ * when the ring is full; falling to throttle_low gives it back. Readers
+ * using read() or RECV_BATCH end it as they consume, mmap readers through
+ * poll() or throttle_work, since their tail moves without the driver.
+ */
+static void rx_throttle_update(struct drvdata *drvdata) {
+        unsigned int fill = drvdata->rx_submit - rx_tail_get(drvdata);
+
+        if (!drvdata->throttled) {
+                if (!drvdata->throttle_high || fill < drvdata->throttle_high)
+                        return;
+                drvdata->throttled = true;
+                drvdata->throttles++;
+                drvdata->throttle_start_ns = ktime_get_ns();
+                cdev_spi_bus_busy_get(drvdata->bus);
+                queue_delayed_work(system_wq, &drvdata->throttle_work,
+                        msecs_to_jiffies(CDEV_SPI_THROTTLE_POLL_MS));
+        } else if (fill <= drvdata->throttle_low || !drvdata->throttle_high) {
+                drvdata->throttled = false;
+                drvdata->throttle_ns += ktime_get_ns() -
+                                        drvdata->throttle_start_ns;
+                cdev_spi_bus_busy_put(drvdata->bus);
+        }
+}
+
+/**
+ * @brief End throttling once the reader caught up
+ */
+static void rx_throttle_check(struct drvdata *drvdata) {
+        unsigned long flags;
+
+        if (!READ_ONCE(drvdata->throttled))
+                return;
+        spin_lock_irqsave(&drvdata->rx_lock, flags);
+        rx_throttle_update(drvdata);
+        spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+}
+
+static void rx_throttle_work_fn(struct work_struct *work) {
+        struct drvdata *drvdata = container_of(to_delayed_work(work),
+                                               struct drvdata, throttle_work);
+
+        spin_lock_irq(&drvdata->rx_lock);
+        rx_throttle_update(drvdata);
+        if (drvdata->throttled)
+                queue_delayed_work(system_wq, &drvdata->throttle_work,
+                        msecs_to_jiffies(CDEV_SPI_THROTTLE_POLL_MS));
+        spin_unlock_irq(&drvdata->rx_lock);
+}
+
+/**
+ * @brief Claim the next free frame buffer and raise BUSY
+ *
+ * Counts a missed edge and returns NULL when all buffers are in flight or
+ * still queued for the reader. Replayed frames leave BUSY and throttling
+ * alone, the device is not on the bus then; a full ring drops them.
+ */
+static struct rx_frame *rx_frame_get(struct drvdata *drvdata) {
+        unsigned long flags;
+        struct rx_frame *frame;
+        bool replaying = READ_ONCE(drvdata->replaying);
+
+        spin_lock_irqsave(&drvdata->rx_lock, flags);
+        if (drvdata->rx_submit - rx_tail_get(drvdata) > drvdata->rx_mask) {
+                drvdata->missed_edges++;
+                if (drvdata->throttled)
+                        drvdata->throttle_drops++;
+                spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+                return NULL;
+        }
+        if (drvdata->throttled)
+                drvdata->throttle_saved++;
+        frame = &drvdata->frames[drvdata->rx_submit & drvdata->rx_mask];
+        frame->seq = drvdata->rx_submit;
+        frame->len = rx_header ? 0 : drvdata->frame_size;
+        frame->irq_ns = READ_ONCE(drvdata->irq_ns);
+        frame->status = 0;
+        frame->chunks_done = 0;
+        frame->crc = crc_variant->init;
+        frame->crc_len = 0;
+        if (drvdata->rx_submit == drvdata->rx_retired && !replaying)
+                cdev_spi_bus_busy_get(drvdata->bus);
+        /* Pairs with the bus picking the frame up */
+        smp_store_release(&drvdata->rx_submit, drvdata->rx_submit + 1);
+        if (!replaying)
+                rx_throttle_update(drvdata);
+        spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+
+        return frame;
+}
+
+/**
+ * @brief Build the SPI messages receiving into a frame buffer
+ *
+ * All but the last chunk set cs_change, so CS stays asserted from one
+ * chunk message to the next and the device sees a single frame.
+ * With rx_header the header message comes first, also with cs_change,
+ * and the length of the single payload chunk is set from the header.
+ * The outbound command is clocked with the header, or else with the
+ * first bytes of chunk 0 in a transfer of its own.
+ */
+static void rx_frame_prepare(struct rx_frame *frame) {
+        int i;
+        struct rx_chunk *chunk;
+        struct drvdata *drvdata = frame->drvdata;
+        u32 speed_hz = drvdata->speed_hz;
+        size_t len = (drvdata->frame_size + CDEV_SPI_RX_CRC_SIZE) / rx_chunks;
+
+        if (rx_header) {
+                frame->hdr_xfer = (struct spi_transfer) {
+                        .speed_hz = speed_hz,
+                        .tx_buf = frame->cmd,
+                        .rx_buf = frame->hdr,
+                        .len = sizeof(struct cdev_spi_frame_hdr),
+                        .cs_change = 1
+                };
+                spi_message_init_with_transfers(&frame->hdr_msg,
+                                                &frame->hdr_xfer, 1);
+                frame->hdr_msg.complete = rx_hdr_complete;
+                frame->hdr_msg.context = frame;
+        }
+
+        for (i = 0; i < rx_chunks; i++) {
+                chunk = &frame->chunks[i];
+                chunk->frame = frame;
+                chunk->index = i;
+                chunk->xfer = (struct spi_transfer) {
+                        .speed_hz = speed_hz,
+                        .bits_per_word = drvdata->bits_per_word,
+                        .rx_nbits = drvdata->rx_nbits,
+                        .rx_buf = frame->rx_data + i * len,
+                        .len = len,
+                        .cs_change = i < rx_chunks - 1
+                };
+                spi_message_init(&chunk->msg);
+                if (i == 0 && !rx_header) {
+                        frame->cmd_xfer = (struct spi_transfer) {
+                                .speed_hz = speed_hz,
+                                .bits_per_word = drvdata->bits_per_word,
+                                .tx_buf = frame->cmd,
+                                .rx_buf = frame->rx_data,
+                                .len = sizeof(struct cdev_spi_cmd)
+                        };
+                        chunk->xfer.rx_buf += sizeof(struct cdev_spi_cmd);
+                        chunk->xfer.len -= sizeof(struct cdev_spi_cmd);
+                        spi_message_add_tail(&frame->cmd_xfer, &chunk->msg);
+                }
+                spi_message_add_tail(&chunk->xfer, &chunk->msg);
+                chunk->msg.complete = rx_chunk_complete;
+                chunk->msg.context = chunk;
+        }
+}
+
+/**
+ * @brief Start reception of a frame with spi_async()
+ *
+ * With rx_prebuilt the messages were built (and optimized, where the kernel
+ * supports it) at probe time and are only resubmitted here.
+ */
+static void get_block_async(struct rx_frame *frame) {
+        int i = 0;
+        int retval = 0;
+        u64 setup_ns;
+        ktime_t t0 = ktime_get();
+        struct drvdata *drvdata = frame->drvdata;
+
+        rx_frame_start(frame);
+        if (!rx_prebuilt)
+                rx_frame_prepare(frame);
+
+        /* One extra count, so the frame cannot complete while submitting */
+        atomic_set(&frame->pending, rx_chunks + 1);
+        if (rx_header)
+                /* The payload is submitted when the header is in */
+                retval = spi_async(drvdata->spidev, &frame->hdr_msg);
+        else
+                for (i = 0; i < rx_chunks; i++) {
+                        retval = spi_async(drvdata->spidev, &frame->chunks[i].msg);
+                        if (retval)
+                                break;
+                }
+
+        setup_ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+        drvdata->setup_ns += setup_ns;
+        drvdata->setup_ns_max = max(drvdata->setup_ns_max, setup_ns);
+        drvdata->setup_count++;
+
+        if (retval) {
+                /* Chunks not queued will not complete. Drop their counts */
+                frame->status = retval;
+                atomic_sub(rx_chunks - i, &frame->pending);
+        }
+        if (atomic_dec_and_test(&frame->pending))
+                rx_frame_complete(frame);
+}
+
+/**
+ * @brief SPI completion callback of the header. May run in atomic context
+ *
+ * Clocks only the payload and CRC the header announced. The payload
+ * message is sent even after a bad header, empty, to release CS.
+ */
+static void rx_hdr_complete(void *context) {
+        int len;
+        int retval;
+        struct rx_frame *frame = (struct rx_frame *) context;
+        struct rx_chunk *chunk = &frame->chunks[0];
+
+        len = frame->hdr_msg.status;
+        if (!len)
+                len = rx_frame_hdr_parse(frame);
+        if (len < 0)
+                frame->status = len;
+        chunk->xfer.len = len < 0 ? 0 : len + CDEV_SPI_RX_CRC_SIZE;
+
+        retval = spi_async(frame->drvdata->spidev, &chunk->msg);
+        if (retval) {
+                if (!frame->status)
+                        frame->status = retval;
+                if (atomic_dec_and_test(&frame->pending))
+                        rx_frame_complete(frame);
+        }
+}
+
+/**
+ * @brief SPI completion callback of a chunk. May run in atomic context
+ */
+static void rx_chunk_complete(void *context) {
+        struct rx_chunk *chunk = (struct rx_chunk *) context;
+        struct rx_frame *frame = chunk->frame;
+
+        if (chunk->msg.status && !frame->status)
+                frame->status = chunk->msg.status;
+
+        /*
+         * Publish before the count drops: the last chunk may then complete
+         * the frame, which can be prepared again and reset chunks_done.
+         * Only chunks following on from chunk 0 count, so rx_work never
+         * folds in one that has not landed, whatever the completion order.
+         */
+        if (chunk->index == READ_ONCE(frame->chunks_done))
+                smp_store_release(&frame->chunks_done, chunk->index + 1);
+        if (atomic_dec_and_test(&frame->pending)) {
+                rx_frame_complete(frame);
+                return;
+        }
+        /* Let rx_work start on the CRC */
+        if (rx_chunks > 1)
+                queue_work(system_highpri_wq, &frame->drvdata->rx_work);
+}
+
+/**
+ * @brief Build the receive messages once. Reused for every frame
+ */
+static int rx_frames_prepare(struct drvdata *drvdata) {
+        int i;
+        int j __maybe_unused;
+        int retval = 0;
+
+        for (i = 0; i < rx_frames; i++) {
+                rx_frame_prepare(&drvdata->frames[i]);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+                /*
+                 * Validate, split and let the controller precompute once.
+                 * The payload length changes per frame with rx_header, so
+                 * only the header message is optimized then.
+                 */
+                if (rx_header) {
+                        retval = devm_spi_optimize_message(&drvdata->spidev->dev,
+                                        drvdata->spidev,
+                                        &drvdata->frames[i].hdr_msg);
+                        if (retval)
+                                break;
+                        continue;
+                }
+                for (j = 0; j < rx_chunks && !retval; j++)
+                        retval = devm_spi_optimize_message(&drvdata->spidev->dev,
+                                        drvdata->spidev,
+                                        &drvdata->frames[i].chunks[j].msg);
+                if (retval)
+                        break;
+#endif
+        }
+
+        return retval;
+}
+
+/**
+ * @brief Put drvdata->speed_hz into the prebuilt messages
+ *
+ * Only with the bus paused. Optimized messages are validated again, the
+ * controller may have precomputed its clock divider.
+ */
+static int rx_frames_speed(struct drvdata *drvdata) {
+        int i;
+        int j;
+        int retval = 0;
+        struct rx_frame *frame;
+
+        for (i = 0; i < rx_frames && !retval; i++) {
+                frame = &drvdata->frames[i];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+                /* Undoes any split, so the transfers below are the real ones */
+                if (rx_header)
+                        spi_unoptimize_message(&frame->hdr_msg);
+                else
+                        for (j = 0; j < rx_chunks; j++)
+                                spi_unoptimize_message(&frame->chunks[j].msg);
+#endif
+                frame->hdr_xfer.speed_hz = drvdata->speed_hz;
+                frame->cmd_xfer.speed_hz = drvdata->speed_hz;
+                for (j = 0; j < rx_chunks; j++)
+                        frame->chunks[j].xfer.speed_hz = drvdata->speed_hz;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+                if (rx_header)
+                        retval = spi_optimize_message(drvdata->spidev,
+                                                      &frame->hdr_msg);
+                else
+                        for (j = 0; j < rx_chunks && !retval; j++)
+                                retval = spi_optimize_message(drvdata->spidev,
+                                                &frame->chunks[j].msg);
+#endif
+        }
+
+        return retval;
+}
+
+/**
+ * @brief Frame done, successful or not. May run in atomic context
+ *
+ * The frame retires only after the bus has started the next one, so
+ * remove() waiting for rx_retired knows nothing here touches the device
+ * or the bus any more.
+ */
+static void rx_frame_complete(struct rx_frame *frame) {
+        unsigned long flags;
+        struct drvdata *drvdata = frame->drvdata;
+        u64 xfer_ns;
+
+        frame->end_ns = ktime_get_ns();
+        xfer_ns = frame->end_ns - frame->start_ns;
+        cdev_spi_hist_add(&drvdata->hist_xfer, xfer_ns);
+        trace_cdev_spi_done(drvdata->minor, frame->seq, frame->status, xfer_ns);
+
+        spin_lock_irqsave(&drvdata->rx_lock, flags);
+        drvdata->rx_done++;
+        spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+
+        queue_work(system_highpri_wq, &drvdata->rx_work);
+        /* Replayed frames never went through the bus */
+        if (rx_async && !READ_ONCE(drvdata->replaying))
+                cdev_spi_bus_done(drvdata->bus);
+
+        spin_lock_irqsave(&drvdata->rx_lock, flags);
+        if (++drvdata->rx_retired == drvdata->rx_submit) {
+                if (!READ_ONCE(drvdata->replaying))
+                        cdev_spi_bus_busy_put(drvdata->bus);
+                wake_up(&drvdata->rx_idle);
+        }
+        spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+}
+
+/*
+ * Per SPI bus coordinator. Devices on one controller share the BUSY line
+ * and take turns on the bus: READY edges only claim a frame buffer, and
+ * the bus starts claimed frames, at most bus_depth at a time. The next
+ * frame comes from the device with the highest mycomp,priority that has
+ * one pending, round robin between devices of equal priority.
+ */
+static struct rx_frame *cdev_spi_bus_next(struct cdev_spi_bus *bus) {
+        struct drvdata *drvdata;
+        struct drvdata *next = NULL;
+
+        list_for_each_entry(drvdata, &bus->devices, bus_node) {
+                /* A claim after the re-read started sees retrying set */
+                if (smp_load_acquire(&drvdata->rx_submit) == drvdata->rx_start ||
+                    READ_ONCE(drvdata->retrying))
+                        continue;
+                if (!next || drvdata->priority > next->priority)
+                        next = drvdata;
+        }
+        if (!next)
+                return NULL;
+
+        list_move_tail(&next->bus_node, &bus->devices);
+        return &next->frames[next->rx_start++ & next->rx_mask];
+}
+
+/**
+ * @brief Start pending frames while the bus has room
+ *
+ * Safe from any context. Only one caller submits at a time, others just
+ * leave their frames to it.
+ */
+static void cdev_spi_bus_kick(struct cdev_spi_bus *bus) {
+        unsigned long flags;
+        struct rx_frame *frame;
+
+        /* Synchronous frames are received by the READY thread itself */
+        if (!rx_async)
+                return;
+
+        spin_lock_irqsave(&bus->lock, flags);
+        if (bus->kicking)
+                goto out;
+        bus->kicking = true;
+        while (!bus->paused && bus->inflight < bus_depth &&
+               (frame = cdev_spi_bus_next(bus))) {
+                bus->inflight++;
+                spin_unlock_irqrestore(&bus->lock, flags);
+                get_block_async(frame);
+                spin_lock_irqsave(&bus->lock, flags);
+        }
+        bus->kicking = false;
+out:
+        spin_unlock_irqrestore(&bus->lock, flags);
+}
+
+static void cdev_spi_bus_done(struct cdev_spi_bus *bus) {
+        unsigned long flags;
+
+        spin_lock_irqsave(&bus->lock, flags);
+        if (!--bus->inflight)
+                wake_up(&bus->idle);
+        spin_unlock_irqrestore(&bus->lock, flags);
+
+        cdev_spi_bus_kick(bus);
+}
+
+static bool cdev_spi_bus_idle(struct cdev_spi_bus *bus) {
+        bool idle;
+
+        spin_lock_irq(&bus->lock);
+        idle = !bus->inflight;
+        spin_unlock_irq(&bus->lock);
+
+        return idle;
+}
+
+/**
+ * @brief Hold back new frames and wait for the bus to drain. May sleep
+ *
+ * Used around an extra message that must not land between the chunks or
+ * the header and payload of another frame.
+ */
+static void cdev_spi_bus_pause(struct cdev_spi_bus *bus) {
+        spin_lock_irq(&bus->lock);
+        bus->paused++;
+        spin_unlock_irq(&bus->lock);
+
+        wait_event(bus->idle, cdev_spi_bus_idle(bus));
+}
+
+static void cdev_spi_bus_resume(struct cdev_spi_bus *bus) {
+        spin_lock_irq(&bus->lock);
+        bus->paused--;
+        spin_unlock_irq(&bus->lock);
+
+        cdev_spi_bus_kick(bus);
+}
+
+/**
+ * @brief Change the SPI clock of the frame transfers. May sleep
+ *
+ * The bus is drained first, so no frame is on the wire with half of its
+ * transfers at the old clock.
+ */
+static int cdev_spi_set_speed(struct drvdata *drvdata, u32 speed_hz) {
+        int retval = 0;
+
+        mutex_lock(&drvdata->speed_lock);
+        cdev_spi_bus_pause(drvdata->bus);
+        WRITE_ONCE(drvdata->speed_hz, speed_hz);
+        if (rx_prebuilt)
+                retval = rx_frames_speed(drvdata);
+        cdev_spi_bus_resume(drvdata->bus);
+        mutex_unlock(&drvdata->speed_lock);
+
+        return retval;
+}
+
+/*
+ * BUSY is raised while any device on the bus has frames claimed.
+ */
+static void cdev_spi_bus_busy_get(struct cdev_spi_bus *bus) {
+        unsigned long flags;
+
+        spin_lock_irqsave(&bus->lock, flags);
+        /* NULL only while BUSY passes to another device */
+        if (!bus->busy_count++ && bus->busy)
+                gpiod_set_value(bus->busy, 1);
+        spin_unlock_irqrestore(&bus->lock, flags);
+}
+
+static void cdev_spi_bus_busy_put(struct cdev_spi_bus *bus) {
+        unsigned long flags;
+
+        spin_lock_irqsave(&bus->lock, flags);
+        if (!--bus->busy_count && bus->busy)
+                gpiod_set_value(bus->busy, 0);
+        spin_unlock_irqrestore(&bus->lock, flags);
+}
+
+/**
+ * @brief Join the coordinator of the device's SPI controller
+ *
+ * The first device on a controller creates it and requests BUSY. Later
+ * devices share that line, their own mycomp,busy-gpios is only used if
+ * BUSY passes to them when the device that requested it leaves.
+ */
+static int cdev_spi_bus_get(struct drvdata *drvdata) {
+        int retval = 0;
+        struct cdev_spi_bus *bus;
+        struct spi_device *spidev = drvdata->spidev;
+
+        mutex_lock(&cdev_spi_lock);
+        list_for_each_entry(bus, &cdev_spi_buses, node)
+                if (bus->ctlr == spidev->controller)
+                        goto found;
+
+        bus = kzalloc(sizeof(struct cdev_spi_bus), GFP_KERNEL);
+        if (!bus) {
+                retval = -ENOMEM;
+                goto out;
+        }
+        bus->busy = gpiod_get(&spidev->dev, "mycomp,busy", GPIOD_OUT_LOW);
+        if (IS_ERR(bus->busy)) {
+                retval = PTR_ERR(bus->busy);
+                dev_err(&spidev->dev, "gpiod_get failed for BUSY\n");
+                kfree(bus);
+                goto out;
+        }
+        bus->busy_owner = drvdata;
+        bus->ctlr = spidev->controller;
+        spin_lock_init(&bus->lock);
+        init_waitqueue_head(&bus->idle);
+        INIT_LIST_HEAD(&bus->devices);
+        list_add_tail(&bus->node, &cdev_spi_buses);
+found:
+        bus->users++;
+        spin_lock_irq(&bus->lock);
+        list_add_tail(&drvdata->bus_node, &bus->devices);
+        spin_unlock_irq(&bus->lock);
+        drvdata->bus = bus;
+out:
+        mutex_unlock(&cdev_spi_lock);
+        return retval;
+}
+
+/**
+ * @brief Request BUSY again for a device staying on the bus. May sleep
+ *
+ * Called with cdev_spi_lock held when the device BUSY was requested for
+ * leaves, as its descriptor goes with it. The line is released before it
+ * is requested again, so it may float for that moment. Without BUSY the
+ * bus carries on, the device just is not held off.
+ */
+static void cdev_spi_bus_busy_handover(struct cdev_spi_bus *bus) {
+        struct gpio_desc *busy;
+        struct drvdata *next;
+
+        spin_lock_irq(&bus->lock);
+        busy = bus->busy;
+        bus->busy = NULL;
+        next = list_first_entry(&bus->devices, struct drvdata, bus_node);
+        spin_unlock_irq(&bus->lock);
+        bus->busy_owner = next;
+        if (busy)
+                gpiod_put(busy);
+
+        busy = gpiod_get(&next->spidev->dev, "mycomp,busy", GPIOD_OUT_LOW);
+        if (IS_ERR(busy)) {
+                dev_err(&next->spidev->dev, "gpiod_get failed for BUSY %ld\n",
+                        PTR_ERR(busy));
+                return;
+        }
+        spin_lock_irq(&bus->lock);
+        bus->busy = busy;
+        gpiod_set_value(busy, bus->busy_count > 0);
+        spin_unlock_irq(&bus->lock);
+}
+
+/**
+ * @brief Leave the bus. Only called with no frame of the device in flight
+ *
+ * Every kick runs either in the READY thread (done after free_irq()) or
+ * in a frame completion before the frame retires, so no kick is left
+ * once all devices have left.
+ */
+static void cdev_spi_bus_put(void *data) {
+        struct drvdata *drvdata = (struct drvdata *) data;
+        struct cdev_spi_bus *bus = drvdata->bus;
+
+        mutex_lock(&cdev_spi_lock);
+        spin_lock_irq(&bus->lock);
+        list_del(&drvdata->bus_node);
+        spin_unlock_irq(&bus->lock);
+        if (!--bus->users) {
+                list_del(&bus->node);
+                if (bus->busy)
+                        gpiod_put(bus->busy);
+                kfree(bus);
+        } else if (bus->busy_owner == drvdata) {
+                cdev_spi_bus_busy_handover(bus);
+        }
+        mutex_unlock(&cdev_spi_lock);
+}
+
+/**
+ * @brief Read a frame that failed CRC again. May sleep, runs in retry_work
+ *
+ * The device is expected to keep the last frame until the next one is
+ * clocked, and to send it again when the command block carries
+ * CDEV_SPI_CMD_RETRANSMIT with its seq. Each attempt waits longer first
+ * and, with rx_retry_slow, runs at half the clock of the one before.
+ * The whole frame, header included, is read as one message with the
+ * bus drained, so nothing gets in between. Other devices on the bus
+ * carry on between attempts.
+ */
+static bool rx_frame_retry(struct drvdata *drvdata, struct rx_frame *frame) {
+        int retval;
+        unsigned int attempt;
+        unsigned int len = frame->len;
+        struct spi_message msg;
+        struct spi_device *spidev = drvdata->spidev;
+        u16 seq = rx_header ? le16_to_cpu(frame->hdr->seq) : frame->seq;
+        struct spi_transfer t[2] = {
+                {
+                        .bits_per_word = rx_header ? 8 : drvdata->bits_per_word,
+                        .tx_buf = frame->cmd,
+                        .rx_buf = rx_header ? (void *) frame->hdr :
+                                              frame->rx_data,
+                        .len = rx_header ? sizeof(struct cdev_spi_frame_hdr) :
+                                           sizeof(struct cdev_spi_cmd)
+                }, {
+                        .bits_per_word = drvdata->bits_per_word,
+                        .rx_nbits = drvdata->rx_nbits,
+                        .rx_buf = frame->rx_data +
+                                  (rx_header ? 0 : sizeof(struct cdev_spi_cmd)),
+                        .len = len + CDEV_SPI_RX_CRC_SIZE -
+                               (rx_header ? 0 : sizeof(struct cdev_spi_cmd))
+                }
+        };
+
+        for (attempt = 0; attempt < READ_ONCE(rx_retries); attempt++) {
+                fsleep((unsigned long) READ_ONCE(rx_retry_us) << attempt);
+
+                *frame->cmd = (struct cdev_spi_cmd) {
+                        .type = CDEV_SPI_CMD_RETRANSMIT,
+                        .seq = cpu_to_le16(seq)
+                };
+                if (!rx_header)
+                        cdev_spi_swab_words(frame->cmd,
+                                            sizeof(struct cdev_spi_cmd),
+                                            drvdata->bits_per_word);
+                t[0].speed_hz = t[1].speed_hz = max(drvdata->speed_hz >>
+                                (rx_retry_slow ? attempt + 1 : 0), 1U);
+                spi_message_init_with_transfers(&msg, t, 2);
+
+                cdev_spi_bus_pause(drvdata->bus);
+                retval = spi_sync(spidev, &msg);
+                cdev_spi_bus_resume(drvdata->bus);
+                if (retval) {
+                        drvdata->spi_errors++;
+                        continue;
+                }
+                if (rx_header && (rx_frame_hdr_parse(frame) != len ||
+                                  le16_to_cpu(frame->hdr->seq) != seq)) {
+                        drvdata->hdr_errors++;
+                        continue;
+                }
+
+                frame->crc = crc_variant->init;
+                frame->crc_len = 0;
+                if (process_frame(drvdata, frame)) {
+                        drvdata->rx_recovered++;
+                        return true;
+                }
+        }
+
+        drvdata->rx_lost++;
+        return false;
+}
+
+/**
+ * @brief Hand the frame at rx_head to retry_work, if it can be read again
+ *
+ * Only the last frame the device sent can be asked for again, so no
+ * frame may have been claimed after it. Until the re-read is done, BUSY
+ * is held and frames claimed meanwhile wait: the bus skips the device
+ * and synchronous receive waits in rx_frame_receive(). Returns false, and
+ * the frame stays an error, when the device has moved on.
+ */
+static bool rx_retry_start(struct drvdata *drvdata, struct rx_frame *frame) {
+        bool last;
+
+        spin_lock_irq(&drvdata->rx_lock);
+        last = drvdata->rx_done == drvdata->rx_submit &&
+               frame->seq + 1 == drvdata->rx_submit;
+        if (last)
+                drvdata->retrying = true;
+        spin_unlock_irq(&drvdata->rx_lock);
+        if (!last) {
+                drvdata->rx_lost++;
+                return false;
+        }
+
+        cdev_spi_bus_busy_get(drvdata->bus);
+        queue_work(cdev_spi_retry_wq, &drvdata->retry_work);
+        return true;
+}
+
+static void rx_retry_work_fn(struct work_struct *work) {
+        struct drvdata *drvdata = container_of(work, struct drvdata,
+                                               retry_work);
+        /* rx_work waits for us, so rx_head stays put */
+        struct rx_frame *frame = &drvdata->frames[drvdata->rx_head &
+                                                  drvdata->rx_mask];
+
+        frame->valid = rx_frame_retry(drvdata, frame);
+        drvdata->retry_done = true;
+        spin_lock_irq(&drvdata->rx_lock);
+        drvdata->retrying = false;
+        spin_unlock_irq(&drvdata->rx_lock);
+        wake_up(&drvdata->rx_idle);
+        cdev_spi_bus_busy_put(drvdata->bus);
+        cdev_spi_bus_kick(drvdata->bus);
+        queue_work(system_highpri_wq, &drvdata->rx_work);
+}
+
+static unsigned long link_errors(struct drvdata *drvdata) {
+        return READ_ONCE(drvdata->crc_errors) + READ_ONCE(drvdata->hdr_errors) +
+               READ_ONCE(drvdata->spi_errors);
+}
+
+/**
+ * @brief Step the clock down when the error rate climbs
+ *
+ * Errors are counted over windows of link_err_window frames. Training
+ * makes its own errors on purpose, its frames do not count.
+ */
+static void rx_link_check(struct drvdata *drvdata) {
+        unsigned int window = READ_ONCE(link_err_window);
+        unsigned long errors = link_errors(drvdata);
+
+        /* Replayed errors say nothing about the link now */
+        if (window && !READ_ONCE(drvdata->training) &&
+            !READ_ONCE(drvdata->replaying)) {
+                if (drvdata->rx_head - drvdata->link_head < window)
+                        return;
+                if (errors - drvdata->link_errors > READ_ONCE(link_err_max) &&
+                    READ_ONCE(drvdata->speed_hz) > drvdata->spidev->max_speed_hz)
+                        queue_work(system_wq, &drvdata->slow_work);
+        }
+        drvdata->link_head = drvdata->rx_head;
+        drvdata->link_errors = errors;
+}
+
+/**
+ * @brief Run the frame filter on a frame that passed the CRC check
+ *
+ * Returns false to drop the frame, else cuts frame->len to the bytes to
+ * deliver. The BPF program loads below prog_end only, at most frame_size,
+ * checked on attach.
+ */
+static bool rx_frame_filter(struct drvdata *drvdata, struct rx_frame *frame,
+                            const struct cdev_spi_filter *filter,
+                            const struct bpf_prog *prog,
+                            unsigned int prog_end) {
+        u32 ret;
+        u32 word;
+        bool match;
+        bool repeat;
+        unsigned int len = frame->len;
+
+        /* The CRC is there already, no need to compare the payload */
+        repeat = frame->crc == drvdata->filter_crc &&
+                 frame->len == drvdata->filter_len;
+        drvdata->filter_crc = frame->crc;
+        drvdata->filter_len = frame->len;
+        if (filter->flags & CDEV_SPI_FILTER_DROP_REPEAT && repeat)
+                return false;
+
+        if (filter->flags & (CDEV_SPI_FILTER_DROP_MATCH |
+                             CDEV_SPI_FILTER_KEEP_MATCH)) {
+                match = false;
+                if (filter->offset + sizeof(word) <= frame->len) {
+                        memcpy(&word, frame->rx_data + filter->offset,
+                               sizeof(word));
+                        match = (word & filter->mask) == filter->value;
+                }
+                if (match == !!(filter->flags & CDEV_SPI_FILTER_DROP_MATCH))
+                        return false;
+        }
+        if (filter->slice)
+                len = min(len, filter->slice);
+
+        if (prog) {
+                /*
+                 * Loads past a short frame read 0, not what the slot held
+                 * before. The CRC there is checked already.
+                 */
+                if (prog_end > frame->len)
+                        memset(frame->rx_data + frame->len, 0,
+                               prog_end - frame->len);
+                ret = bpf_prog_run_pin_on_cpu(prog, frame->rx_data);
+                if (!ret)
+                        return false;
+                len = min(len, ret);
+        }
+        frame->len = len;
+        return true;
+}
+
+/**
+ * @brief Add a completed frame to the record file, as the controller left it
+ *
+ * Called from rx_work only. A record that does not fit is dropped and
+ * counted, a slow reader never holds up the device.
+ */
+static void rx_frame_record(struct drvdata *drvdata, struct rx_frame *frame) {
+        struct cdev_spi_capture rec = {
+                .magic = CDEV_SPI_CAPTURE_MAGIC,
+                .len = frame->status ? 0 : frame->len + CDEV_SPI_RX_CRC_SIZE,
+                .irq_ns = frame->irq_ns,
+                .xfer_ns = frame->end_ns - frame->start_ns,
+                .status = frame->status,
+        };
+
+        if (rx_header) {
+                rec.flags |= CDEV_SPI_CAPTURE_HDR;
+                rec.hdr = *frame->hdr;
+        }
+        if (kfifo_avail(&drvdata->record_fifo) < sizeof(rec) + rec.len) {
+                drvdata->record_drops++;
+                return;
+        }
+        kfifo_in(&drvdata->record_fifo, &rec, sizeof(rec));
+        kfifo_in(&drvdata->record_fifo, frame->rx_data, rec.len);
+        wake_up_interruptible(&drvdata->record_wait);
+}
+
+/**
+ * @brief Check completed frames and queue them for the reader
+ */
+static void rx_work_handler(struct work_struct *work) {
+        u64 t0, crc_ns;
+        unsigned int idx;
+        unsigned int done;
+        unsigned int submit;
+        unsigned long dropped;
+        bool filtered;
+        bool wake = false;
+        struct rx_frame *frame;
+        struct cdev_spi_convert conv;
+        struct cdev_spi_filter filter;
+        struct bpf_prog *prog;
+        unsigned int prog_end;
+        struct drvdata *drvdata = container_of(work, struct drvdata, rx_work);
+
+        spin_lock_irq(&drvdata->rx_lock);
+        /* The frame at rx_head is being read again, retry_work requeues us */
+        if (drvdata->retrying) {
+                spin_unlock_irq(&drvdata->rx_lock);
+                return;
+        }
+        done = drvdata->rx_done;
+        submit = drvdata->rx_submit;
+        conv = drvdata->conv;
+        filter = drvdata->filter;
+        prog = drvdata->filter_prog;
+        prog_end = drvdata->filter_prog_end;
+        spin_unlock_irq(&drvdata->rx_lock);
+
+        if (drvdata->rx_head == done) {
+                /* Frame still on the wire. CRC the chunks that are in */
+                if (done != submit) {
+                        frame = &drvdata->frames[done & drvdata->rx_mask];
+                        rx_frame_crc_update(frame,
+                                smp_load_acquire(&frame->chunks_done));
+                }
+                return;
+        }
+
+        while (drvdata->rx_head != done) {
+                idx = drvdata->rx_head & drvdata->rx_mask;
+                frame = &drvdata->frames[idx];
+                t0 = ktime_get_ns();
+                if (drvdata->retry_done) {
+                        /* Back from retry_work, which set frame->valid */
+                        drvdata->retry_done = false;
+                } else {
+                        if (smp_load_acquire(&drvdata->recording))
+                                rx_frame_record(drvdata, frame);
+                        frame->valid = process_frame(drvdata, frame);
+                        /* Transfer ok but CRC not, so worth another read */
+                        if (!frame->valid && !frame->status &&
+                            READ_ONCE(rx_retries) &&
+                            !READ_ONCE(drvdata->replaying) &&
+                            rx_retry_start(drvdata, frame))
+                                break;
+                }
+                filtered = frame->valid && (filter.flags || filter.slice ||
+                                            prog) &&
+                           !rx_frame_filter(drvdata, frame, &filter, prog,
+                                            prog_end);
+                if (filtered) {
+                        frame->valid = false;
+                        drvdata->filtered++;
+                }
+                wake |= !filtered;
+                /* Still in cache from the CRC. The CRC is not kept */
+                if (frame->valid && conv.format != CDEV_SPI_CONV_NONE)
+                        frame->len = cdev_spi_convert(&conv, frame->rx_data,
+                                                      frame->len,
+                                                      drvdata->bits_per_word);
+                crc_ns = ktime_get_ns() - t0;
+                cdev_spi_hist_add(&drvdata->hist_crc, crc_ns);
+                trace_cdev_spi_crc(drvdata->minor, frame->seq, frame->valid,
+                                   crc_ns);
+                dropped = READ_ONCE(drvdata->missed_edges) + drvdata->seq_gaps;
+                drvdata->ring->slot[idx] = (struct cdev_spi_slot) {
+                        .status = frame->valid ? CDEV_SPI_SLOT_OK :
+                                  filtered ? CDEV_SPI_SLOT_FILTERED :
+                                             CDEV_SPI_SLOT_ERROR,
+                        .len = frame->len,
+                        .seq = rx_header ? le16_to_cpu(frame->hdr->seq) :
+                                           frame->seq,
+                        .flags = rx_header ? frame->hdr->flags : 0,
+                        .frame = frame->seq,
+                        .irq_ns = frame->irq_ns,
+                        .start_ns = frame->start_ns,
+                        .end_ns = frame->end_ns,
+                        .dropped = dropped - drvdata->dropped_seen
+                };
+                drvdata->dropped_seen = dropped;
+                smp_store_release(&drvdata->rx_head, drvdata->rx_head + 1);
+                smp_store_release(&drvdata->ring->head, drvdata->rx_head);
+        }
+        rx_link_check(drvdata);
+        /* Filtered frames only wake readers to pass over them in bulk */
+        if (wake || READ_ONCE(drvdata->training) ||
+            drvdata->rx_head - rx_tail_get(drvdata) > drvdata->rx_mask / 2)
+                wake_up_interruptible(&drvdata->rx_wait);
+}
+
+static bool rx_quiesced(struct drvdata *drvdata) {
+        bool idle;
+
+        spin_lock_irq(&drvdata->rx_lock);
+        idle = drvdata->rx_retired == drvdata->rx_submit && !drvdata->retrying;
+        spin_unlock_irq(&drvdata->rx_lock);
+
+        return idle;
+}
+
+/*
+ * Reader side of the frame queue for read(). Only called with read_lock held.
+ */
+static bool rx_frame_pending(struct drvdata *drvdata) {
+        return smp_load_acquire(&drvdata->rx_head) != rx_tail_get(drvdata);
+}
+
+static unsigned int rx_frames_queued(struct drvdata *drvdata) {
+        return smp_load_acquire(&drvdata->rx_head) - rx_tail_get(drvdata);
+}
+
+static void rx_frame_release(struct drvdata *drvdata) {
+        smp_store_release(&drvdata->ring->tail, rx_tail_get(drvdata) + 1);
+        drvdata->splice_off = 0;
+        rx_throttle_check(drvdata);
+}
+
+/**
+ * @brief Wait for the next valid frame. Frames failing CRC are dropped
+ */
+static struct rx_frame *rx_frame_wait(struct drvdata *drvdata, bool nonblock,
+                                      int *err) {
+        struct rx_frame *frame;
+
+        for (;;) {
+                while (!rx_frame_pending(drvdata)) {
+                        if (READ_ONCE(drvdata->removed))
+                                *err = -ENODEV;
+                        else if (nonblock)
+                                *err = -EAGAIN;
+                        else
+                                *err = wait_event_interruptible(drvdata->rx_wait,
+                                        rx_frame_pending(drvdata) ||
+                                        READ_ONCE(drvdata->removed));
+                        if (*err)
+                                return NULL;
+                }
+                frame = &drvdata->frames[rx_tail_get(drvdata) & drvdata->rx_mask];
+                if (frame->valid)
+                        return frame;
+                rx_frame_release(drvdata);
+        }
+}
+
+/*
+ * SPI clock link training. Starting at spi-max-frequency from DT, the clock
+ * goes up link_train_step percent at a time, up to link_train_max_hz or
+ * what the controller can do. At each step link_train_frames frames from
+ * the device must pass CRC. The fastest clean clock, less
+ * link_train_margin percent, is kept. Frames received meanwhile are used up
+ * by the training and not handed to readers.
+ */
+
+/**
+ * @brief Receive link_train_frames frames at the current clock
+ *
+ * Called with read_lock held. Returns the errors seen, or -ETIMEDOUT when
+ * the device sent too few frames.
+ */
+static int link_train_frames_check(struct drvdata *drvdata) {
+        unsigned int head;
+        unsigned long errors;
+        long left = msecs_to_jiffies(READ_ONCE(link_train_ms));
+
+        /* Frames still coming from the clock before do not count */
+        flush_work(&drvdata->rx_work);
+        while (rx_frame_pending(drvdata))
+                rx_frame_release(drvdata);
+        head = READ_ONCE(drvdata->rx_head);
+        errors = link_errors(drvdata);
+
+        for (;;) {
+                while (rx_frame_pending(drvdata))
+                        rx_frame_release(drvdata);
+                if (READ_ONCE(drvdata->rx_head) - head >=
+                    READ_ONCE(link_train_frames))
+                        return min_t(unsigned long,
+                                     link_errors(drvdata) - errors, INT_MAX);
+                if (READ_ONCE(drvdata->train_cancel))
+                        return -ECANCELED;
+                if (!left)
+                        return -ETIMEDOUT;
+                left = wait_event_interruptible_timeout(drvdata->rx_wait,
+                                rx_frame_pending(drvdata) ||
+                                READ_ONCE(drvdata->train_cancel), left);
+                if (left < 0)
+                        return left;
+        }
+}
+
+static int link_train_run(struct drvdata *drvdata) {
+        int errors;
+        u32 next;
+        u32 good = 0;
+        u32 base = drvdata->spidev->max_speed_hz;
+        u32 max_hz = READ_ONCE(link_train_max_hz) ?:
+                     drvdata->spidev->controller->max_speed_hz ?: base;
+        u32 hz = base;
+        unsigned int margin = min(READ_ONCE(link_train_margin), 100U);
+
+        for (;;) {
+                errors = cdev_spi_set_speed(drvdata, hz);
+                if (!errors)
+                        errors = link_train_frames_check(drvdata);
+                if (errors < 0)
+                        break;
+                DEV_DEBUG(&drvdata->spidev->dev,
+                          "Link training at %u Hz: %d errors\n", hz, errors);
+                if (errors)
+                        break;
+                good = hz;
+
+                next = min_t(u64, hz + mult_frac((u64) hz,
+                                        READ_ONCE(link_train_step), 100),
+                             max_hz);
+                if (next <= hz)
+                        break;
+                hz = next;
+        }
+
+        /* spi-max-frequency is the floor, it was set by hand */
+        hz = good > base ? max(mult_frac(good, 100 - margin, 100), base) : base;
+        cdev_spi_set_speed(drvdata, hz);
+        if (errors < 0 && errors != -ETIMEDOUT)
+                return errors;
+        if (!good)
+                return errors < 0 ? errors : -EIO;
+        dev_info(&drvdata->spidev->dev, "Link trained, SPI clock %u Hz\n", hz);
+        return 0;
+}
+
+static void link_train_work_fn(struct work_struct *work) {
+        struct drvdata *drvdata = container_of(work, struct drvdata,
+                                               train_work);
+
+        /* Readers wait until the training is over */
+        mutex_lock(&drvdata->read_lock);
+        WRITE_ONCE(drvdata->training, true);
+        drvdata->train_result = link_train_run(drvdata);
+        WRITE_ONCE(drvdata->training, false);
+        mutex_unlock(&drvdata->read_lock);
+
+        if (drvdata->train_result)
+                dev_warn(&drvdata->spidev->dev,
+                         "Link training failed %d, SPI clock %u Hz\n",
+                         drvdata->train_result, drvdata->speed_hz);
+}
+
+/**
+ * @brief Step the clock down by link_train_margin after too many errors
+ */
+static void link_slow_work_fn(struct work_struct *work) {
+        struct drvdata *drvdata = container_of(work, struct drvdata,
+                                               slow_work);
+        u32 base = drvdata->spidev->max_speed_hz;
+        u32 hz = READ_ONCE(drvdata->speed_hz);
+        unsigned int margin = min(READ_ONCE(link_train_margin), 100U);
+
+        if (READ_ONCE(drvdata->training) || hz <= base)
+                return;
+        hz = max(mult_frac(hz, 100 - margin, 100), base);
+        if (hz == drvdata->speed_hz)
+                hz = base;
+        cdev_spi_set_speed(drvdata, hz);
+        drvdata->link_slowdowns++;
+        dev_warn(&drvdata->spidev->dev, "SPI errors, clock down to %u Hz\n",
+                 hz);
+}
+
+/*
+ * Character device. One minor per SPI device, /dev/cdev_spi<minor>.
+ * Each read() returns one frame payload (without CRC), after its struct
+ * cdev_spi_slot when the file has CDEV_SPI_IOC_SET_META on. A short buffer
+ * truncates the frame; the rest of it is discarded.
+ */
+
+/**
+ * @brief Per open file state
+ */
+struct cdev_spi_file {
+        struct drvdata *drvdata;
+        bool meta;                       /* Frames come after their slot */
+        bool mapped;                     /* Slots mapped, reads the ring itself */
+};
+
+static struct drvdata *cdev_spi_drvdata(struct file *file) {
+        return ((struct cdev_spi_file *) file->private_data)->drvdata;
+}
+
+static void drvdata_release(struct kref *kref) {
+        int i;
+        struct drvdata *drvdata = container_of(kref, struct drvdata, kref);
+
+        for (i = 0; drvdata->frames && i < rx_frames; i++) {
+                kfree(drvdata->frames[i].chunks);
+                kfree(drvdata->frames[i].hdr);
+                kfree(drvdata->frames[i].cmd);
+        }
+        if (drvdata->filter_prog)
+                bpf_prog_destroy(drvdata->filter_prog);
+        vfree(drvdata->ring);
+        kfree(drvdata->frames);
+        kfree(drvdata);
+}
+
+static void drvdata_put(void *data) {
+        struct drvdata *drvdata = (struct drvdata *) data;
+
+        kref_put(&drvdata->kref, drvdata_release);
+}
+
+static int cdev_spi_open(struct inode *inode, struct file *file) {
+        struct drvdata *drvdata = NULL;
+        struct cdev_spi_file *cfile;
+        unsigned int minor = iminor(inode);
+
+        cfile = kzalloc(sizeof(*cfile), GFP_KERNEL);
+        if (!cfile)
+                return -ENOMEM;
+
+        mutex_lock(&cdev_spi_lock);
+        if (minor < CDEV_SPI_DEVNO_MINORS)
+                drvdata = cdev_spi_devices[minor];
+        if (drvdata)
+                kref_get(&drvdata->kref);
+        mutex_unlock(&cdev_spi_lock);
+        if (!drvdata) {
+                kfree(cfile);
+                return -ENODEV;
+        }
+
+        cfile->drvdata = drvdata;
+        file->private_data = cfile;
+        return stream_open(inode, file);
+}
+
+static int cdev_spi_release(struct inode *inode, struct file *file) {
+        struct cdev_spi_file *cfile = file->private_data;
+
+        drvdata_put(cfile->drvdata);
+        kfree(cfile);
+        return 0;
+}
+
+/**
+ * @brief Copy the frame at the tail, with its slot first if meta
+ *
+ * Returns the bytes copied, at most count, or -EFAULT.
+ */
+static ssize_t rx_frame_copy(struct drvdata *drvdata, struct rx_frame *frame,
+                             bool meta, char __user *buf, size_t count) {
+        size_t len = 0;
+        unsigned int idx = frame - drvdata->frames;
+
+        if (meta) {
+                len = min(count, sizeof(struct cdev_spi_slot));
+                if (copy_to_user(buf, &drvdata->ring->slot[idx], len))
+                        return -EFAULT;
+        }
+        count = min_t(size_t, count - len, frame->len);
+        if (copy_to_user(buf + len, frame->rx_data, count))
+                return -EFAULT;
+        return len + count;
+}
+
+static ssize_t cdev_spi_read(struct file *file, char __user *buf,
+                             size_t count, loff_t *ppos) {
+        int err = 0;
+        ssize_t retval;
+        struct rx_frame *frame;
+        struct cdev_spi_file *cfile = file->private_data;
+        struct drvdata *drvdata = cfile->drvdata;
+
+        if (mutex_lock_interruptible(&drvdata->read_lock))
+                return -ERESTARTSYS;
+
+        frame = rx_frame_wait(drvdata, file->f_flags & O_NONBLOCK, &err);
+        if (!frame) {
+                retval = err;
+                goto out;
+        }
+
+        retval = rx_frame_copy(drvdata, frame, cfile->meta, buf, count);
+        trace_cdev_spi_dequeue(drvdata->minor, frame->seq, retval);
+        rx_frame_release(drvdata);
+out:
+        mutex_unlock(&drvdata->read_lock);
+        return retval;
+}
+
+/*
+ * splice() and sendfile() copy each frame into pages the pipe owns. A
+ * socket on the other end may still send from them long after the pipe
+ * let go, so the ring pages themselves are never handed out.
+ */
+static const struct pipe_buf_operations cdev_spi_pipe_buf_ops = {
+        .release = generic_pipe_buf_release,
+        .get = generic_pipe_buf_get,
+};
+
+/**
+ * @brief Copy len bytes of the record of a frame, from off on
+ *
+ * The record is the slot, if meta, then the payload, as read() returns it.
+ */
+static void rx_frame_record_copy(struct drvdata *drvdata,
+                                 struct rx_frame *frame, size_t meta_len,
+                                 size_t off, u8 *dst, size_t len) {
+        size_t n;
+
+        if (off < meta_len) {
+                n = min(len, meta_len - off);
+                memcpy(dst, (u8 *) &drvdata->ring->slot[frame -
+                                        drvdata->frames] + off, n);
+                dst += n;
+                off += n;
+                len -= n;
+        }
+        memcpy(dst, frame->rx_data + off - meta_len, len);
+}
+
+/**
+ * @brief Copy the frame at the tail into the pipe, from splice_off on
+ *
+ * Stops after len bytes or when the pipe is full; splice_off keeps the
+ * place for the next call. Returns the bytes added or an error.
+ */
+static ssize_t rx_frame_splice(struct drvdata *drvdata, struct rx_frame *frame,
+                               bool meta, struct pipe_inode_info *pipe,
+                               size_t len) {
+        size_t n;
+        ssize_t retval;
+        size_t done = 0;
+        size_t off = drvdata->splice_off;
+        size_t meta_len = meta ? sizeof(struct cdev_spi_slot) : 0;
+        size_t total = meta_len + frame->len;
+        struct page *page;
+        struct pipe_buffer buf;
+
+        while (off < total && done < len &&
+               !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+                n = min_t(size_t, min(total - off, len - done), PAGE_SIZE);
+                page = alloc_page(GFP_KERNEL);
+                if (!page) {
+                        retval = -ENOMEM;
+                        goto out;
+                }
+                rx_frame_record_copy(drvdata, frame, meta_len, off,
+                                     page_address(page), n);
+                buf = (struct pipe_buffer) {
+                        .page = page,
+                        .len = n,
+                        .ops = &cdev_spi_pipe_buf_ops,
+                };
+                /* Releases buf itself on failure */
+                retval = add_to_pipe(pipe, &buf);
+                if (retval < 0)
+                        goto out;
+                off += n;
+                done += n;
+        }
+
+        drvdata->splice_off = off;
+        if (off == total) {
+                trace_cdev_spi_dequeue(drvdata->minor, frame->seq, total);
+                rx_frame_release(drvdata);
+        }
+        return done;
+
+out:
+        drvdata->splice_off = off;
+        return done ? done : retval;
+}
+
+/**
+ * @brief splice() and sendfile() of frames, one copy into the pipe
+ *
+ * Gives the same byte stream as read() of whole frames, so with meta on
+ * each record starts with its struct cdev_spi_slot. Waits for the first
+ * frame unless O_NONBLOCK or SPLICE_F_NONBLOCK, like read().
+ */
+static ssize_t cdev_spi_splice_read(struct file *file, loff_t *ppos,
+                                    struct pipe_inode_info *pipe, size_t len,
+                                    unsigned int flags) {
+        int err = 0;
+        ssize_t n;
+        ssize_t retval = 0;
+        struct rx_frame *frame;
+        struct cdev_spi_file *cfile = file->private_data;
+        struct drvdata *drvdata = cfile->drvdata;
+        bool nonblock = file->f_flags & O_NONBLOCK ||
+                        flags & SPLICE_F_NONBLOCK;
+
+        if (mutex_lock_interruptible(&drvdata->read_lock))
+                return -ERESTARTSYS;
+
+        while (len && !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+                /* Only wait while nothing was handed over yet */
+                frame = rx_frame_wait(drvdata, nonblock || retval, &err);
+                if (!frame)
+                        break;
+                n = rx_frame_splice(drvdata, frame, READ_ONCE(cfile->meta),
+                                    pipe, len);
+                if (n < 0) {
+                        err = n;
+                        break;
+                }
+                retval += n;
+                len -= n;
+        }
+
+        mutex_unlock(&drvdata->read_lock);
+        return retval ? retval : err;
+}
+
+/**
+ * @brief Queue outbound commands
+ *
+ * Takes whole struct cdev_spi_cmd entries. Each goes out with the next
+ * frame. Blocks while the queue is full, unless O_NONBLOCK.
+ */
+static ssize_t cdev_spi_write(struct file *file, const char __user *buf,
+                              size_t count, loff_t *ppos) {
+        int retval;
+        unsigned int n;
+        struct cdev_spi_cmd cmds[CDEV_SPI_TX_CMDS];
+        struct drvdata *drvdata = cdev_spi_drvdata(file);
+
+        n = min_t(size_t, count / sizeof(struct cdev_spi_cmd), CDEV_SPI_TX_CMDS);
+        if (!n)
+                return -EINVAL;
+        if (copy_from_user(cmds, buf, n * sizeof(struct cdev_spi_cmd)))
+                return -EFAULT;
+
+        for (;;) {
+                if (READ_ONCE(drvdata->removed))
+                        return -ENODEV;
+                n = kfifo_in_spinlocked(&drvdata->tx_fifo, cmds, n,
+                                        &drvdata->tx_lock);
+                if (n)
+                        return n * sizeof(struct cdev_spi_cmd);
+                if (file->f_flags & O_NONBLOCK)
+                        return -EAGAIN;
+                retval = wait_event_interruptible(drvdata->tx_wait,
+                                !kfifo_is_full(&drvdata->tx_fifo) ||
+                                READ_ONCE(drvdata->removed));
+                if (retval)
+                        return retval;
+                n = min_t(size_t, count / sizeof(struct cdev_spi_cmd),
+                          CDEV_SPI_TX_CMDS);
+        }
+}
+
+/**
+ * @brief Dequeue many frames in one call, like recvmmsg()
+ *
+ * Waits for min_frames queued frames (frames failing CRC included, they
+ * are skipped) or timeout_ms, then returns as many frames as fit in
+ * max_frames and buf_len without waiting further. A first frame larger
+ * than buf_len is truncated, as with read().
+ */
+static long cdev_spi_recv_batch(struct file *file,
+                                struct cdev_spi_batch __user *ubatch) {
+        long retval;
+        ssize_t len;
+        size_t offset = 0;
+        unsigned int n = 0;
+        unsigned int idx;
+        unsigned int min_frames;
+        struct rx_frame *frame;
+        struct cdev_spi_batch batch;
+        struct cdev_spi_frame_desc desc;
+        struct cdev_spi_file *cfile = file->private_data;
+        struct drvdata *drvdata = cfile->drvdata;
+        size_t meta = cfile->meta ? sizeof(struct cdev_spi_slot) : 0;
+
+        if (copy_from_user(&batch, ubatch, sizeof(batch)))
+                return -EFAULT;
+        if (!batch.max_frames || batch.min_frames > batch.max_frames)
+                return -EINVAL;
+        min_frames = clamp(batch.min_frames, 1U, drvdata->rx_mask + 1);
+
+        if (mutex_lock_interruptible(&drvdata->read_lock))
+                return -ERESTARTSYS;
+
+        if (!(file->f_flags & O_NONBLOCK)) {
+                retval = wait_event_interruptible_timeout(drvdata->rx_wait,
+                                rx_frames_queued(drvdata) >= min_frames ||
+                                READ_ONCE(drvdata->removed),
+                                batch.timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT :
+                                msecs_to_jiffies(batch.timeout_ms));
+                if (retval < 0)
+                        goto out;
+        }
+
+        while (n < batch.max_frames && rx_frame_pending(drvdata)) {
+                idx = rx_tail_get(drvdata) & drvdata->rx_mask;
+                frame = &drvdata->frames[idx];
+                if (!frame->valid) {
+                        rx_frame_release(drvdata);
+                        continue;
+                }
+                if (offset + meta + frame->len > batch.buf_len && n)
+                        break;
+                len = rx_frame_copy(drvdata, frame, cfile->meta,
+                                    u64_to_user_ptr(batch.buf) + offset,
+                                    batch.buf_len - offset);
+                if (len < 0) {
+                        retval = len;
+                        goto out;
+                }
+
+                desc = (struct cdev_spi_frame_desc) {
+                        .offset = offset,
+                        .len = len,
+                        .seq = drvdata->ring->slot[idx].seq,
+                        .flags = drvdata->ring->slot[idx].flags
+                };
+                if (copy_to_user(u64_to_user_ptr(batch.descs) +
+                                 n * sizeof(desc), &desc, sizeof(desc))) {
+                        retval = -EFAULT;
+                        goto out;
+                }
+                trace_cdev_spi_dequeue(drvdata->minor, frame->seq, len);
+                rx_frame_release(drvdata);
+                offset += len;
+                n++;
+        }
+
+        if (put_user(n, &ubatch->nr_frames))
+                retval = -EFAULT;
+        else if (n)
+                retval = n;
+        else if (READ_ONCE(drvdata->removed))
+                retval = -ENODEV;
+        else
+                retval = file->f_flags & O_NONBLOCK ? -EAGAIN : 0;
+out:
+        mutex_unlock(&drvdata->read_lock);
+        return retval;
+}
+
+static int cdev_spi_filter_check(struct drvdata *drvdata,
+                                 const struct cdev_spi_filter *filter) {
+        if (filter->flags & ~(CDEV_SPI_FILTER_DROP_MATCH |
+                              CDEV_SPI_FILTER_KEEP_MATCH |
+                              CDEV_SPI_FILTER_DROP_REPEAT) ||
+            (filter->flags & CDEV_SPI_FILTER_DROP_MATCH &&
+             filter->flags & CDEV_SPI_FILTER_KEEP_MATCH) ||
+            filter->offset % sizeof(u32) ||
+            filter->offset >= drvdata->frame_size)
+                return -EINVAL;
+        return 0;
+}
+
+/**
+ * @brief Make classic BPF load from the payload, like seccomp does
+ *
+ * ld [k] becomes a load from the context, which is the frame. Every other
+ * load that would look for a socket buffer is refused. Offsets are only
+ * checked against the largest frame here, see cdev_spi_bpf_attach().
+ */
+static int cdev_spi_bpf_check(struct sock_filter *filter, unsigned int flen) {
+        unsigned int pc;
+        u16 code;
+
+        for (pc = 0; pc < flen; pc++) {
+                code = filter[pc].code;
+                if (code == (BPF_LD | BPF_W | BPF_ABS)) {
+                        if (filter[pc].k % sizeof(u32) ||
+                            filter[pc].k >= CDEV_SPI_RX_MAX_FRAME_SIZE)
+                                return -EINVAL;
+                        filter[pc].code = BPF_LDX | BPF_W | BPF_ABS;
+                } else if ((BPF_CLASS(code) == BPF_LD ||
+                            BPF_CLASS(code) == BPF_LDX) &&
+                           BPF_MODE(code) != BPF_IMM &&
+                           BPF_MODE(code) != BPF_MEM) {
+                        return -EINVAL;
+                }
+        }
+        return 0;
+}
+
+/**
+ * @brief Put prog in place of the BPF filter, NULL to detach. May sleep
+ *
+ * rx_work takes its own copy of the pointer, so the old program goes
+ * once rx_work is done with it.
+ */
+static void cdev_spi_bpf_swap(struct drvdata *drvdata, struct bpf_prog *prog,
+                              unsigned int prog_end) {
+        struct bpf_prog *old;
+
+        spin_lock_irq(&drvdata->rx_lock);
+        old = drvdata->filter_prog;
+        drvdata->filter_prog = prog;
+        drvdata->filter_prog_end = prog_end;
+        spin_unlock_irq(&drvdata->rx_lock);
+        if (old) {
+                flush_work(&drvdata->rx_work);
+                bpf_prog_destroy(old);
+        }
+}
+
+static int cdev_spi_bpf_attach(struct drvdata *drvdata,
+                               const struct cdev_spi_bpf __user *ubpf) {
+        int retval;
+        unsigned int pc;
+        unsigned int end = 0;
+        struct cdev_spi_bpf bpf;
+        struct sock_fprog fprog;
+        struct sock_fprog_kern *orig;
+        struct bpf_prog *prog;
+
+        if (copy_from_user(&bpf, ubpf, sizeof(bpf)))
+                return -EFAULT;
+        if (!bpf.len || bpf.len > BPF_MAXINSNS)
+                return -EINVAL;
+        fprog.len = bpf.len;
+        fprog.filter = u64_to_user_ptr(bpf.insns);
+        retval = bpf_prog_create_from_user(&prog, &fprog, cdev_spi_bpf_check,
+                                           true);
+        if (retval)
+                return retval;
+
+        /* Loads must stay below the frame size of this device */
+        orig = prog->orig_prog;
+        for (pc = 0; pc < orig->len; pc++)
+                if (orig->filter[pc].code == (BPF_LD | BPF_W | BPF_ABS))
+                        end = max_t(unsigned int, end,
+                                    orig->filter[pc].k + sizeof(u32));
+        if (end > drvdata->frame_size) {
+                bpf_prog_destroy(prog);
+                return -EINVAL;
+        }
+        cdev_spi_bpf_swap(drvdata, prog, end);
+        return 0;
+}
+
+static long cdev_spi_ioctl(struct file *file, unsigned int cmd,
+                           unsigned long arg) {
+        long retval;
+        u32 meta;
+        unsigned long flags;
+        struct cdev_spi_convert conv;
+        struct cdev_spi_filter filter;
+        struct cdev_spi_file *cfile = file->private_data;
+        struct drvdata *drvdata = cfile->drvdata;
+
+        switch (cmd) {
+        case CDEV_SPI_IOC_SEND_CMD:
+                retval = cdev_spi_write(file, (const char __user *) arg,
+                                        sizeof(struct cdev_spi_cmd), NULL);
+                return retval < 0 ? retval : 0;
+        case CDEV_SPI_IOC_FLUSH_CMDS:
+                spin_lock_irqsave(&drvdata->tx_lock, flags);
+                kfifo_reset(&drvdata->tx_fifo);
+                spin_unlock_irqrestore(&drvdata->tx_lock, flags);
+                wake_up_interruptible(&drvdata->tx_wait);
+                return 0;
+        case CDEV_SPI_IOC_RECV_BATCH:
+                return cdev_spi_recv_batch(file,
+                                (struct cdev_spi_batch __user *) arg);
+        case CDEV_SPI_IOC_SET_META:
+                if (get_user(meta, (u32 __user *) arg))
+                        return -EFAULT;
+                WRITE_ONCE(cfile->meta, !!meta);
+                return 0;
+        case CDEV_SPI_IOC_SET_CONVERT:
+                if (copy_from_user(&conv, (void __user *) arg, sizeof(conv)))
+                        return -EFAULT;
+                retval = cdev_spi_convert_check(&conv);
+                if (retval)
+                        return retval;
+                spin_lock_irq(&drvdata->rx_lock);
+                drvdata->conv = conv;
+                spin_unlock_irq(&drvdata->rx_lock);
+                return 0;
+        case CDEV_SPI_IOC_GET_CONVERT:
+                spin_lock_irq(&drvdata->rx_lock);
+                conv = drvdata->conv;
+                spin_unlock_irq(&drvdata->rx_lock);
+                if (copy_to_user((void __user *) arg, &conv, sizeof(conv)))
+                        return -EFAULT;
+                return 0;
+        case CDEV_SPI_IOC_SET_FILTER:
+                if (copy_from_user(&filter, (void __user *) arg,
+                                   sizeof(filter)))
+                        return -EFAULT;
+                retval = cdev_spi_filter_check(drvdata, &filter);
+                if (retval)
+                        return retval;
+                spin_lock_irq(&drvdata->rx_lock);
+                drvdata->filter = filter;
+                spin_unlock_irq(&drvdata->rx_lock);
+                return 0;
+        case CDEV_SPI_IOC_GET_FILTER:
+                spin_lock_irq(&drvdata->rx_lock);
+                filter = drvdata->filter;
+                spin_unlock_irq(&drvdata->rx_lock);
+                if (copy_to_user((void __user *) arg, &filter, sizeof(filter)))
+                        return -EFAULT;
+                return 0;
+        case CDEV_SPI_IOC_ATTACH_BPF:
+                return cdev_spi_bpf_attach(drvdata,
+                                (const struct cdev_spi_bpf __user *) arg);
+        case CDEV_SPI_IOC_DETACH_BPF:
+                cdev_spi_bpf_swap(drvdata, NULL, 0);
+                return 0;
+        default:
+                return -ENOTTY;
+        }
+}
+
+/**
+ * @brief A frame read() would return is queued
+ *
+ * Lockless. Frames before rx_head are checked and stay as they are.
+ */
+static bool rx_frame_deliverable(struct drvdata *drvdata) {
+        unsigned int pos;
+        unsigned int head = smp_load_acquire(&drvdata->rx_head);
+
+        for (pos = rx_tail_get(drvdata); pos != head; pos++)
+                if (drvdata->frames[pos & drvdata->rx_mask].valid)
+                        return true;
+        return false;
+}
+
+/**
+ * @brief POLLIN only for frames readers get
+ *
+ * Filtered and failed frames are passed over here, else nothing would
+ * hand their slots back until a frame worth reading came. When a reader
+ * holds read_lock it does that itself. A file that maps the slots sees
+ * every slot and moves the tail over them, so any slot counts for it.
+ */
+static __poll_t cdev_spi_poll(struct file *file, poll_table *wait) {
+        __poll_t mask = 0;
+        struct cdev_spi_file *cfile = file->private_data;
+        struct drvdata *drvdata = cfile->drvdata;
+
+        poll_wait(file, &drvdata->rx_wait, wait);
+        poll_wait(file, &drvdata->tx_wait, wait);
+        /* mmap readers move the tail without telling, look now */
+        rx_throttle_check(drvdata);
+        if (READ_ONCE(cfile->mapped)) {
+                if (smp_load_acquire(&drvdata->rx_head) != rx_tail_get(drvdata))
+                        mask |= EPOLLIN | EPOLLRDNORM;
+        } else {
+                if (mutex_trylock(&drvdata->read_lock)) {
+                        while (rx_frame_pending(drvdata) &&
+                               !drvdata->frames[rx_tail_get(drvdata) &
+                                                drvdata->rx_mask].valid)
+                                rx_frame_release(drvdata);
+                        mutex_unlock(&drvdata->read_lock);
+                }
+                if (rx_frame_deliverable(drvdata))
+                        mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        if (!kfifo_is_full(&drvdata->tx_fifo))
+                mask |= EPOLLOUT | EPOLLWRNORM;
+        if (READ_ONCE(drvdata->removed))
+                mask |= EPOLLHUP | EPOLLERR;
+
+        return mask;
+}
+
+/*
+ * mmap() of the frame ring. A mapping holds a reference on drvdata.
+ */
+static void cdev_spi_vm_open(struct vm_area_struct *vma) {
+        struct drvdata *drvdata = vma->vm_private_data;
+
+        kref_get(&drvdata->kref);
+}
+
+static void cdev_spi_vm_close(struct vm_area_struct *vma) {
+        drvdata_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct cdev_spi_vm_ops = {
+        .open = cdev_spi_vm_open,
+        .close = cdev_spi_vm_close,
+};
+
+static int cdev_spi_mmap(struct file *file, struct vm_area_struct *vma) {
+        int retval;
+        struct cdev_spi_file *cfile = file->private_data;
+        struct drvdata *drvdata = cfile->drvdata;
+
+        /* Mapping the header page alone is fine for reading the geometry */
+        if (vma->vm_pgoff ||
+            vma->vm_end - vma->vm_start > drvdata->ring_size)
+                return -EINVAL;
+
+        retval = remap_vmalloc_range(vma, drvdata->ring, 0);
+        if (retval)
+                return retval;
+
+        vma->vm_private_data = drvdata;
+        vma->vm_ops = &cdev_spi_vm_ops;
+        cdev_spi_vm_open(vma);
+        if (vma->vm_end - vma->vm_start > drvdata->data_offset)
+                WRITE_ONCE(cfile->mapped, true);
+
+        return 0;
+}
+
+static const struct file_operations cdev_spi_fops = {
+        .owner = THIS_MODULE,
+        .open = cdev_spi_open,
+        .release = cdev_spi_release,
+        .read = cdev_spi_read,
+        .splice_read = cdev_spi_splice_read,
+        .write = cdev_spi_write,
+        .unlocked_ioctl = cdev_spi_ioctl,
+        .compat_ioctl = compat_ptr_ioctl,
+        .poll = cdev_spi_poll,
+        .mmap = cdev_spi_mmap,
+        .llseek = no_llseek,
+};
+
+/**
+ * @brief Take a free minor and create /dev/cdev_spi<minor>
+ *
+ * Minors are handed out under cdev_spi_lock, so devices probing in
+ * parallel do not collide.
+ */
+static int cdev_spi_register(struct drvdata *drvdata) {
+        int retval;
+        int minor;
+        struct device *dev;
+        struct spi_device *spidev = drvdata->spidev;
+
+        mutex_lock(&cdev_spi_lock);
+        for (minor = 0; minor < CDEV_SPI_DEVNO_MINORS; minor++)
+                if (!cdev_spi_devices[minor])
+                        break;
+        if (minor == CDEV_SPI_DEVNO_MINORS) {
+                retval = -EBUSY;
+                goto err_unlock;
+        }
+
+        drvdata->chardev = cdev_alloc();
+        if (!drvdata->chardev) {
+                retval = -ENOMEM;
+                goto err_unlock;
+        }
+        drvdata->chardev->owner = THIS_MODULE;
+        drvdata->chardev->ops = &cdev_spi_fops;
+        retval = cdev_add(drvdata->chardev, MKDEV(MAJOR(devno), minor), 1);
+        if (retval) {
+                kobject_put(&drvdata->chardev->kobj);
+                goto err_unlock;
+        }
+
+        dev = device_create(cdev_spi_class, &spidev->dev,
+                            MKDEV(MAJOR(devno), minor), drvdata,
+                            CDEV_SPI_DEVNO_NAME "%d", minor);
+        if (IS_ERR(dev)) {
+                retval = PTR_ERR(dev);
+                goto err_cdev;
+        }
+
+        drvdata->minor = minor;
+        cdev_spi_devices[minor] = drvdata;
+        mutex_unlock(&cdev_spi_lock);
+
+        DEV_DEBUG(&spidev->dev, "chardev %s%d\n", CDEV_SPI_DEVNO_NAME, minor);
+
+        return 0;
+
+err_cdev:
+        cdev_del(drvdata->chardev);
+err_unlock:
+        mutex_unlock(&cdev_spi_lock);
+        dev_err(&spidev->dev, "chardev setup failed %d\n", retval);
+        return retval;
+}
+
+static void cdev_spi_unregister(struct drvdata *drvdata) {
+        mutex_lock(&cdev_spi_lock);
+        cdev_spi_devices[drvdata->minor] = NULL;
+        mutex_unlock(&cdev_spi_lock);
+
+        device_destroy(cdev_spi_class, MKDEV(MAJOR(devno), drvdata->minor));
+        cdev_del(drvdata->chardev);
+}
+
+/*
+ * Statistics in sysfs. Used for comparing async and sync receive, and
+ * prebuilt against per frame message setup.
+ */
+#define DRVDATA_ATTR_RO(name)                                                 \
+static ssize_t name##_show(struct device *dev,                                \
+                           struct device_attribute *attr, char *buf) {        \
+        struct drvdata *drvdata = dev_get_drvdata(dev);                       \
+        return sysfs_emit(buf, "%lu\n", READ_ONCE(drvdata->name));            \
+}                                                                             \
+static DEVICE_ATTR_RO(name)
+
+DRVDATA_ATTR_RO(rx_frames);
+DRVDATA_ATTR_RO(rx_bytes);
+DRVDATA_ATTR_RO(crc_errors);
+DRVDATA_ATTR_RO(rx_recovered);
+DRVDATA_ATTR_RO(rx_lost);
+DRVDATA_ATTR_RO(spi_errors);
+DRVDATA_ATTR_RO(missed_edges);
+DRVDATA_ATTR_RO(hdr_errors);
+DRVDATA_ATTR_RO(tx_cmds);
+DRVDATA_ATTR_RO(irqs);
+DRVDATA_ATTR_RO(polled_frames);
+DRVDATA_ATTR_RO(poll_budget_hits);
+DRVDATA_ATTR_RO(seq_gaps);
+DRVDATA_ATTR_RO(link_slowdowns);
+DRVDATA_ATTR_RO(throttles);
+DRVDATA_ATTR_RO(throttle_saved);
+DRVDATA_ATTR_RO(throttle_drops);
+DRVDATA_ATTR_RO(filtered);
+DRVDATA_ATTR_RO(record_drops);
+DRVDATA_ATTR_RO(replay_frames);
+DRVDATA_ATTR_RO(replay_errors);
+
+static ssize_t setup_ns_show(struct device *dev,
+                             struct device_attribute *attr, char *buf) {
+        struct drvdata *drvdata = dev_get_drvdata(dev);
+        unsigned long count = READ_ONCE(drvdata->setup_count);
+
+        return sysfs_emit(buf, "avg %llu max %llu\n",
+                          count ? div_u64(READ_ONCE(drvdata->setup_ns), count) : 0,
+                          READ_ONCE(drvdata->setup_ns_max));
+}
+static DEVICE_ATTR_RO(setup_ns);
+
+static ssize_t speed_hz_show(struct device *dev,
+                             struct device_attribute *attr, char *buf) {
+        struct drvdata *drvdata = dev_get_drvdata(dev);
+
+        return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->speed_hz));
+}
+static DEVICE_ATTR_RO(speed_hz);
+
+/* Time BUSY was held for the reader, the current period included */
+static ssize_t throttle_ns_show(struct device *dev,
+                                struct device_attribute *attr, char *buf) {
+        u64 ns;
+        struct drvdata *drvdata = dev_get_drvdata(dev);
+
+        spin_lock_irq(&drvdata->rx_lock);
+        ns = drvdata->throttle_ns;
+        if (drvdata->throttled)
+                ns += ktime_get_ns() - drvdata->throttle_start_ns;
+        spin_unlock_irq(&drvdata->rx_lock);
+        return sysfs_emit(buf, "%llu\n", ns);
+}
+static DEVICE_ATTR_RO(throttle_ns);
+
+/*
+ * Writing 1 starts link training in the background. Reads give "running",
+ * or the result of the last training, 0 when ok or never run.
+ */
+static ssize_t link_train_show(struct device *dev,
+                               struct device_attribute *attr, char *buf) {
+        struct drvdata *drvdata = dev_get_drvdata(dev);
+
+        if (READ_ONCE(drvdata->training))
+                return sysfs_emit(buf, "running\n");
+        return sysfs_emit(buf, "%d\n", READ_ONCE(drvdata->train_result));
+}
+
+static ssize_t link_train_store(struct device *dev,
+                                struct device_attribute *attr,
+                                const char *buf, size_t count) {
+        bool train;
+        int retval;
+        struct drvdata *drvdata = dev_get_drvdata(dev);
+
+        retval = kstrtobool(buf, &train);
+        if (retval)
+                return retval;
+        if (train)
+                queue_work(system_long_wq, &drvdata->train_work);
+        return count;
+}
+static DEVICE_ATTR_RW(link_train);
+
+/*
+ * Sample conversion, "<format> [le] [signed] [decimate=<n>] [channels=<n>]"
+ * with format none, 16, 32, packed24 or packed12.
+ */
+static ssize_t convert_show(struct device *dev,
+                            struct device_attribute *attr, char *buf) {
+        struct cdev_spi_convert conv;
+        struct drvdata *drvdata = dev_get_drvdata(dev);
+
+        spin_lock_irq(&drvdata->rx_lock);
+        conv = drvdata->conv;
+        spin_unlock_irq(&drvdata->rx_lock);
+        return cdev_spi_convert_show(&conv, buf);
+}
+
+static ssize_t convert_store(struct device *dev,
+                             struct device_attribute *attr,
+                             const char *buf, size_t count) {
+        int retval;
+        char *str;
+        struct cdev_spi_convert conv;
+        struct drvdata *drvdata = dev_get_drvdata(dev);
+
+        str = kstrndup(buf, count, GFP_KERNEL);
+        if (!str)
+                return -ENOMEM;
+        retval = cdev_spi_convert_parse(&conv, str);
+        kfree(str);
+        if (retval)
+                return retval;
+        spin_lock_irq(&drvdata->rx_lock);
+        drvdata->conv = conv;
+        spin_unlock_irq(&drvdata->rx_lock);
+        return count;
+}
+static DEVICE_ATTR_RW(convert);
+
+static struct attribute *cdev_spi_attrs[] = {
+        &dev_attr_rx_frames.attr,
+        &dev_attr_rx_bytes.attr,
+        &dev_attr_crc_errors.attr,
+        &dev_attr_rx_recovered.attr,
+        &dev_attr_rx_lost.attr,
+        &dev_attr_spi_errors.attr,
+        &dev_attr_missed_edges.attr,
+        &dev_attr_hdr_errors.attr,
+        &dev_attr_tx_cmds.attr,
+        &dev_attr_irqs.attr,
+        &dev_attr_polled_frames.attr,
+        &dev_attr_poll_budget_hits.attr,
+        &dev_attr_seq_gaps.attr,
+        &dev_attr_setup_ns.attr,
+        &dev_attr_speed_hz.attr,
+        &dev_attr_link_train.attr,
+        &dev_attr_link_slowdowns.attr,
+        &dev_attr_convert.attr,
+        &dev_attr_throttles.attr,
+        &dev_attr_throttle_ns.attr,
+        &dev_attr_throttle_saved.attr,
+        &dev_attr_throttle_drops.attr,
+        &dev_attr_filtered.attr,
+        &dev_attr_record_drops.attr,
+        &dev_attr_replay_frames.attr,
+        &dev_attr_replay_errors.attr,
+        NULL
+};
+ATTRIBUTE_GROUPS(cdev_spi);
+
+/*
+ * Latency histograms in debugfs, /sys/kernel/debug/cdev_spi/<spi dev>/latency.
+ * Percentiles are the upper bound of the bucket they fall in.
+ */
+static void cdev_spi_hist_show(struct seq_file *s, const char *name,
+                               const struct cdev_spi_hist *hist) {
+        int n;
+        unsigned long total = 0;
+        unsigned long sum = 0;
+        unsigned long bucket[CDEV_SPI_HIST_BUCKETS];
+        u64 p50 = 0, p99 = 0;
+
+        for (n = 0; n < CDEV_SPI_HIST_BUCKETS; n++) {
+                bucket[n] = READ_ONCE(hist->bucket[n]);
+                total += bucket[n];
+        }
+
+        seq_printf(s, "%s: %lu\n", name, total);
+        for (n = 0; n < CDEV_SPI_HIST_BUCKETS; n++) {
+                if (!bucket[n])
+                        continue;
+                sum += bucket[n];
+                if (!p50 && sum * 2 >= total)
+                        p50 = 1ULL << n;
+                if (!p99 && sum * 100 >= total * 99)
+                        p99 = 1ULL << n;
+                if (n == CDEV_SPI_HIST_BUCKETS - 1)
+                        seq_printf(s, "  >= %10llu ns: %lu\n", 1ULL << (n - 1),
+                                   bucket[n]);
+                else
+                        seq_printf(s, "  <  %10llu ns: %lu\n", 1ULL << n,
+                                   bucket[n]);
+        }
+        seq_printf(s, "  p50 < %llu ns, p99 < %llu ns\n", p50, p99);
+}
+
+static int cdev_spi_latency_show(struct seq_file *s, void *unused) {
+        struct drvdata *drvdata = s->private;
+
+        cdev_spi_hist_show(s, "irq_to_start", &drvdata->hist_start);
+        cdev_spi_hist_show(s, "transfer", &drvdata->hist_xfer);
+        cdev_spi_hist_show(s, "crc", &drvdata->hist_crc);
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cdev_spi_latency);
+
+/*
+ * Record and replay of the raw frame stream in debugfs,
+ * /sys/kernel/debug/cdev_spi/<spi dev>/record and .../replay. One reader
+ * and one writer at a time; struct cdev_spi_capture has the format.
+ */
+static size_t rx_capture_size(struct drvdata *drvdata) {
+        size_t rec = sizeof(struct cdev_spi_capture) + drvdata->frame_size +
+                     CDEV_SPI_RX_CRC_SIZE;
+
+        return roundup_pow_of_two(max_t(size_t, (size_t) capture_kb * 1024,
+                                        2 * rec));
+}
+
+static void rx_record_stop(struct drvdata *drvdata) {
+        if (!drvdata->record_buf)
+                return;
+        smp_store_release(&drvdata->recording, false);
+        flush_work(&drvdata->rx_work);
+        vfree(drvdata->record_buf);
+        drvdata->record_buf = NULL;
+}
+
+static int cdev_spi_record_open(struct inode *inode, struct file *file) {
+        int retval = 0;
+        size_t size;
+        struct drvdata *drvdata = inode->i_private;
+
+        mutex_lock(&drvdata->capture_lock);
+        if (drvdata->capture_stop) {
+                retval = -ENODEV;
+                goto out;
+        }
+        if (drvdata->record_buf) {
+                retval = -EBUSY;
+                goto out;
+        }
+        size = rx_capture_size(drvdata);
+        drvdata->record_buf = vmalloc(size);
+        if (!drvdata->record_buf) {
+                retval = -ENOMEM;
+                goto out;
+        }
+        kfifo_init(&drvdata->record_fifo, drvdata->record_buf, size);
+        kref_get(&drvdata->kref);
+        file->private_data = drvdata;
+        smp_store_release(&drvdata->recording, true);
+out:
+        mutex_unlock(&drvdata->capture_lock);
+        if (retval)
+                return retval;
+        return nonseekable_open(inode, file);
+}
+
+static int cdev_spi_record_release(struct inode *inode, struct file *file) {
+        struct drvdata *drvdata = file->private_data;
+
+        mutex_lock(&drvdata->capture_lock);
+        rx_record_stop(drvdata);
+        mutex_unlock(&drvdata->capture_lock);
+        drvdata_put(drvdata);
+        return 0;
+}
+
+/**
+ * @brief Read whole or partial records, in the order frames completed
+ *
+ * Returns 0 (end of file) once the device is removed.
+ */
+static ssize_t cdev_spi_record_read(struct file *file, char __user *buf,
+                                    size_t count, loff_t *ppos) {
+        int retval;
+        unsigned int copied = 0;
+        struct drvdata *drvdata = file->private_data;
+
+        while (count && !copied) {
+                if (kfifo_is_empty(&drvdata->record_fifo) &&
+                    (file->f_flags & O_NONBLOCK))
+                        return -EAGAIN;
+                retval = wait_event_interruptible(drvdata->record_wait,
+                                !kfifo_is_empty(&drvdata->record_fifo) ||
+                                READ_ONCE(drvdata->capture_stop));
+                if (retval)
+                        return retval;
+                if (READ_ONCE(drvdata->capture_stop))
+                        return 0;
+
+                mutex_lock(&drvdata->capture_lock);
+                retval = kfifo_to_user(&drvdata->record_fifo, buf, count,
+                                       &copied);
+                mutex_unlock(&drvdata->capture_lock);
+                if (retval)
+                        return retval;
+        }
+        return copied;
+}
+
+static const struct file_operations cdev_spi_record_fops = {
+        .owner = THIS_MODULE,
+        .open = cdev_spi_record_open,
+        .release = cdev_spi_record_release,
+        .read = cdev_spi_record_read,
+        .llseek = no_llseek,
+};
+
+/**
+ * @brief A whole record, or a corrupt one, is at the front of replay_fifo
+ */
+static bool rx_replay_ready(struct drvdata *drvdata) {
+        struct cdev_spi_capture rec;
+
+        if (kfifo_out_peek(&drvdata->replay_fifo, &rec, sizeof(rec)) !=
+            sizeof(rec))
+                return false;
+        return rec.magic != CDEV_SPI_CAPTURE_MAGIC ||
+               rec.len > drvdata->frame_size + CDEV_SPI_RX_CRC_SIZE ||
+               kfifo_len(&drvdata->replay_fifo) >= sizeof(rec) + rec.len;
+}
+
+/**
+ * @brief Feed records in at the READY edge, paced by replay_speed
+ *
+ * Each record goes through rx_ready() like an interrupt, and
+ * rx_frame_receive() fills the frame from it instead of SPI. Gaps between
+ * irq_ns of the records are kept, scaled by 100 / replay_speed. A record
+ * that is not one of this device's frames loses sync with the stream, so
+ * everything written up to then is dropped.
+ */
+static int rx_replay_thread(void *data) {
+        bool started = false;
+        unsigned int speed;
+        u64 first_ns = 0, t0 = 0;
+        ktime_t at;
+        struct drvdata *drvdata = (struct drvdata *) data;
+        struct cdev_spi_capture *rec = drvdata->replay_rec;
+
+        for (;;) {
+                wait_event_interruptible(drvdata->replay_wait,
+                                         rx_replay_ready(drvdata) ||
+                                         READ_ONCE(drvdata->replay_eof) ||
+                                         kthread_should_stop());
+                if (!rx_replay_ready(drvdata)) {
+                        if (kthread_should_stop() ||
+                            READ_ONCE(drvdata->replay_eof))
+                                break;
+                        continue;
+                }
+
+                kfifo_out_peek(&drvdata->replay_fifo, rec, sizeof(*rec));
+                if (rec->magic != CDEV_SPI_CAPTURE_MAGIC ||
+                    rec->len > drvdata->frame_size + CDEV_SPI_RX_CRC_SIZE) {
+                        drvdata->replay_errors++;
+                        kfifo_reset_out(&drvdata->replay_fifo);
+                        wake_up(&drvdata->replay_wait);
+                        continue;
+                }
+                kfifo_out(&drvdata->replay_fifo, rec, sizeof(*rec) + rec->len);
+                wake_up(&drvdata->replay_wait);
+
+                /* Start over on a record from before the first */
+                if (!started || rec->irq_ns < first_ns) {
+                        started = true;
+                        first_ns = rec->irq_ns;
+                        t0 = ktime_get_ns();
+                }
+                speed = READ_ONCE(replay_speed);
+                if (speed) {
+                        at = ns_to_ktime(t0 + div_u64((rec->irq_ns - first_ns) *
+                                                      100, speed));
+                        set_current_state(TASK_INTERRUPTIBLE);
+                        schedule_hrtimeout(&at, HRTIMER_MODE_ABS);
+                }
+
+                WRITE_ONCE(drvdata->irq_ns, ktime_get_ns());
+                rx_ready(drvdata);
+        }
+
+        WRITE_ONCE(drvdata->replay_done, true);
+        wake_up(&drvdata->replay_wait);
+        /* kthread_stop() wants the thread still there */
+        set_current_state(TASK_INTERRUPTIBLE);
+        while (!kthread_should_stop()) {
+                schedule();
+                set_current_state(TASK_INTERRUPTIBLE);
+        }
+        __set_current_state(TASK_RUNNING);
+        return 0;
+}
+
+/**
+ * @brief Take the device off READY and the bus and start replaying
+ *
+ * Frames in flight finish first. The ring, its readers and the statistics
+ * carry on as before, the replayed frames just follow the received ones.
+ */
+static int rx_replay_start(struct drvdata *drvdata) {
+        int retval;
+        size_t size = rx_capture_size(drvdata);
+        struct cdev_spi_bus *bus = drvdata->bus;
+        struct task_struct *task;
+
+        drvdata->replay_buf = vmalloc(size);
+        drvdata->replay_rec = vmalloc(sizeof(struct cdev_spi_capture) +
+                                      drvdata->frame_size +
+                                      CDEV_SPI_RX_CRC_SIZE);
+        if (!drvdata->replay_buf || !drvdata->replay_rec) {
+                retval = -ENOMEM;
+                goto err_free;
+        }
+        kfifo_init(&drvdata->replay_fifo, drvdata->replay_buf, size);
+        drvdata->replay_eof = false;
+        drvdata->replay_done = false;
+
+        /* The rx_rt worker re-enables the IRQ, let it finish first */
+        disable_irq(drvdata->irq);
+        if (drvdata->rx_worker)
+                kthread_flush_work(&drvdata->rx_ready_work);
+        wait_event(drvdata->rx_idle, rx_quiesced(drvdata));
+        flush_work(&drvdata->retry_work);
+        spin_lock_irq(&bus->lock);
+        list_del_init(&drvdata->bus_node);
+        spin_unlock_irq(&bus->lock);
+        WRITE_ONCE(drvdata->replaying, true);
+
+        task = kthread_run(rx_replay_thread, drvdata, "cdev_spi_replay/%d",
+                           drvdata->minor);
+        if (IS_ERR(task)) {
+                retval = PTR_ERR(task);
+                goto err_resume;
+        }
+        drvdata->replay_task = task;
+        dev_info(&drvdata->spidev->dev, "replaying, READY ignored\n");
+        return 0;
+
+err_resume:
+        WRITE_ONCE(drvdata->replaying, false);
+        spin_lock_irq(&bus->lock);
+        list_add_tail(&drvdata->bus_node, &bus->devices);
+        spin_unlock_irq(&bus->lock);
+        enable_irq(drvdata->irq);
+err_free:
+        vfree(drvdata->replay_rec);
+        vfree(drvdata->replay_buf);
+        drvdata->replay_rec = NULL;
+        drvdata->replay_buf = NULL;
+        return retval;
+}
+
+/**
+ * @brief Stop replaying and go back to READY and the bus
+ *
+ * Replayed frames complete in rx_ready(), so none is in flight once the
+ * thread is gone.
+ */
+static void rx_replay_stop(struct drvdata *drvdata) {
+        struct cdev_spi_bus *bus = drvdata->bus;
+
+        if (!drvdata->replay_task)
+                return;
+        kthread_stop(drvdata->replay_task);
+        drvdata->replay_task = NULL;
+        flush_work(&drvdata->rx_work);
+
+        WRITE_ONCE(drvdata->replaying, false);
+        spin_lock_irq(&bus->lock);
+        drvdata->rx_start = drvdata->rx_submit;
+        list_add_tail(&drvdata->bus_node, &bus->devices);
+        spin_unlock_irq(&bus->lock);
+        enable_irq(drvdata->irq);
+
+        vfree(drvdata->replay_rec);
+        vfree(drvdata->replay_buf);
+        drvdata->replay_rec = NULL;
+        drvdata->replay_buf = NULL;
+        dev_info(&drvdata->spidev->dev, "replay done, %lu frames\n",
+                 READ_ONCE(drvdata->replay_frames));
+}
+
+static int cdev_spi_replay_open(struct inode *inode, struct file *file) {
+        int retval = 0;
+        struct drvdata *drvdata = inode->i_private;
+
+        mutex_lock(&drvdata->capture_lock);
+        if (drvdata->capture_stop)
+                retval = -ENODEV;
+        else if (drvdata->replay_task)
+                retval = -EBUSY;
+        else
+                retval = rx_replay_start(drvdata);
+        if (!retval) {
+                kref_get(&drvdata->kref);
+                file->private_data = drvdata;
+        }
+        mutex_unlock(&drvdata->capture_lock);
+        if (retval)
+                return retval;
+        return nonseekable_open(inode, file);
+}
+
+/**
+ * @brief Play out what was written, then go back to the device
+ */
+static int cdev_spi_replay_release(struct inode *inode, struct file *file) {
+        struct drvdata *drvdata = file->private_data;
+
+        WRITE_ONCE(drvdata->replay_eof, true);
+        wake_up(&drvdata->replay_wait);
+        wait_event(drvdata->replay_wait, READ_ONCE(drvdata->replay_done) ||
+                                         READ_ONCE(drvdata->capture_stop));
+
+        mutex_lock(&drvdata->capture_lock);
+        rx_replay_stop(drvdata);
+        mutex_unlock(&drvdata->capture_lock);
+        drvdata_put(drvdata);
+        return 0;
+}
+
+static ssize_t cdev_spi_replay_write(struct file *file, const char __user *buf,
+                                     size_t count, loff_t *ppos) {
+        int retval;
+        unsigned int copied = 0;
+        struct drvdata *drvdata = file->private_data;
+
+        while (count && !copied) {
+                if (kfifo_is_full(&drvdata->replay_fifo) &&
+                    (file->f_flags & O_NONBLOCK))
+                        return -EAGAIN;
+                retval = wait_event_interruptible(drvdata->replay_wait,
+                                !kfifo_is_full(&drvdata->replay_fifo) ||
+                                READ_ONCE(drvdata->capture_stop));
+                if (retval)
+                        return retval;
+                if (READ_ONCE(drvdata->capture_stop))
+                        return -ENODEV;
+
+                mutex_lock(&drvdata->capture_lock);
+                retval = kfifo_from_user(&drvdata->replay_fifo, buf, count,
+                                         &copied);
+                mutex_unlock(&drvdata->capture_lock);
+                if (retval)
+                        return retval;
+        }
+        wake_up(&drvdata->replay_wait);
+        return copied;
+}
+
+static const struct file_operations cdev_spi_replay_fops = {
+        .owner = THIS_MODULE,
+        .open = cdev_spi_replay_open,
+        .release = cdev_spi_replay_release,
+        .write = cdev_spi_replay_write,
+        .llseek = no_llseek,
+};
+
+/**
+ * @brief Probe SPI and GPIO
+*/
+static int module_probe(struct spi_device *spidev) {
+        int i;
+        int retval;
+        struct drvdata *drvdata;
+
+        DEV_DEBUG(&spidev->dev, "probing\n");
+
+        drvdata = (struct drvdata *) kzalloc(sizeof(struct drvdata), GFP_KERNEL);
+        if (!drvdata)
+                return -ENOMEM;
+        kref_init(&drvdata->kref);
+        retval = devm_add_action_or_reset(&spidev->dev, drvdata_put, drvdata);
+        if (retval)
+                return retval;
+
+        drvdata->spidev = spidev;
+        spin_lock_init(&drvdata->rx_lock);
+        INIT_WORK(&drvdata->rx_work, rx_work_handler);
+        INIT_WORK(&drvdata->retry_work, rx_retry_work_fn);
+        init_waitqueue_head(&drvdata->rx_idle);
+        init_waitqueue_head(&drvdata->rx_wait);
+        mutex_init(&drvdata->read_lock);
+        INIT_KFIFO(drvdata->tx_fifo);
+        spin_lock_init(&drvdata->tx_lock);
+        init_waitqueue_head(&drvdata->tx_wait);
+        mutex_init(&drvdata->speed_lock);
+        INIT_WORK(&drvdata->train_work, link_train_work_fn);
+        INIT_WORK(&drvdata->slow_work, link_slow_work_fn);
+        INIT_DELAYED_WORK(&drvdata->throttle_work, rx_throttle_work_fn);
+        mutex_init(&drvdata->capture_lock);
+        init_waitqueue_head(&drvdata->record_wait);
+        init_waitqueue_head(&drvdata->replay_wait);
+
+        drvdata->frame_size = rx_frame_size;
+        of_property_read_u32(spidev->dev.of_node, "mycomp,max-frame-size",
+                             &drvdata->frame_size);
+        if (!drvdata->frame_size ||
+            drvdata->frame_size > CDEV_SPI_RX_MAX_FRAME_SIZE ||
+            drvdata->frame_size % sizeof(u32) ||
+            (drvdata->frame_size + CDEV_SPI_RX_CRC_SIZE) / rx_chunks <=
+                                sizeof(struct cdev_spi_cmd) ||
+            (drvdata->frame_size + CDEV_SPI_RX_CRC_SIZE) %
+                                (rx_chunks * sizeof(u32))) {
+                dev_err(&spidev->dev, "Frame size %u not usable. Must be a "
+                        "multiple of 4 up to %d, split in rx_chunks\n",
+                        drvdata->frame_size, CDEV_SPI_RX_MAX_FRAME_SIZE);
+                return -EINVAL;
+        }
+        /* Room to unpack a full frame in place, see CDEV_SPI_IOC_SET_CONVERT */
+        drvdata->slot_size = PAGE_ALIGN(max_t(size_t,
+                                drvdata->frame_size + CDEV_SPI_RX_CRC_SIZE,
+                                CDEV_SPI_CONVERT_SIZE(drvdata->frame_size)));
+
+        drvdata->rx_mask = rx_frames - 1;
+        drvdata->throttle_high = DIV_ROUND_UP(rx_frames * rx_throttle_high, 100);
+        drvdata->throttle_low = rx_frames * rx_throttle_low / 100;
+        drvdata->frames = kcalloc(rx_frames, sizeof(struct rx_frame), GFP_KERNEL);
+        if (!drvdata->frames)
+                return -ENOMEM;
+
+        /*
+         * Page backed and mappable. The SPI core maps vmalloc buffers for
+         * DMA. Slots are page aligned so no cache line of a slot is shared
+         * with other data while the controller writes to it.
+         */
+        drvdata->data_offset = PAGE_ALIGN(struct_size(drvdata->ring, slot,
+                                                      rx_frames));
+        drvdata->ring_size = drvdata->data_offset +
+                             rx_frames * drvdata->slot_size;
+        drvdata->ring = vmalloc_user(drvdata->ring_size);
+        if (!drvdata->ring)
+                return -ENOMEM;
+        drvdata->ring->nr_slots = rx_frames;
+        drvdata->ring->slot_size = drvdata->slot_size;
+        drvdata->ring->frame_size = drvdata->frame_size;
+        drvdata->ring->data_offset = drvdata->data_offset;
+
+        for (i = 0; i < rx_frames; i++) {
+                drvdata->frames[i].drvdata = drvdata;
+                drvdata->frames[i].rx_data = (u8 *) drvdata->ring +
+                                        drvdata->data_offset +
+                                        i * drvdata->slot_size;
+                drvdata->frames[i].chunks = kcalloc(rx_chunks,
+                                        sizeof(struct rx_chunk), GFP_KERNEL);
+                if (!drvdata->frames[i].chunks)
+                        return -ENOMEM;
+                /* Zero padded to the header it is clocked out with */
+                drvdata->frames[i].cmd = kzalloc(max(sizeof(struct cdev_spi_cmd),
+                                        sizeof(struct cdev_spi_frame_hdr)),
+                                                 GFP_KERNEL);
+                if (!drvdata->frames[i].cmd)
+                        return -ENOMEM;
+                if (!rx_header)
+                        continue;
+                /* Own allocation, so it does not share cache lines for DMA */
+                drvdata->frames[i].hdr = kmalloc(sizeof(struct cdev_spi_frame_hdr),
+                                                 GFP_KERNEL);
+                if (!drvdata->frames[i].hdr)
+                        return -ENOMEM;
+        }
+
+        retval = rx_rt_setup(drvdata);
+        if (retval)
+                return retval;
+
+        retval = spi_setup(spidev);
+        if (retval < 0) {
+                dev_err(&spidev->dev, "Error in probe. Returned %d\n", retval);
+                return retval;
+        }
+        DEV_DEBUG(&spidev->dev, "spi_setup success\n");
+        /* Until link training finds better */
+        drvdata->speed_hz = spidev->max_speed_hz;
+
+        /*
+         * spi_setup() already dropped spi-rx-bus-width from the mode if the
+         * controller cannot do it. Commands go out full duplex, so only
+         * receive only transfers use more lines.
+         */
+        drvdata->rx_nbits = spidev->mode & SPI_RX_QUAD ? SPI_NBITS_QUAD :
+                            spidev->mode & SPI_RX_DUAL ? SPI_NBITS_DUAL :
+                                                         SPI_NBITS_SINGLE;
+        /* The module parameter, when given, wins over DT */
+        drvdata->bits_per_word = 8;
+        of_property_read_u32(spidev->dev.of_node, "spi-bits-per-word",
+                             &drvdata->bits_per_word);
+        if (rx_bits_per_word)
+                drvdata->bits_per_word = rx_bits_per_word;
+        if (drvdata->bits_per_word != 8 && drvdata->bits_per_word != 16 &&
+            drvdata->bits_per_word != 32) {
+                dev_err(&spidev->dev, "%u bits per word not usable. Must be "
+                        "8, 16 or 32\n", drvdata->bits_per_word);
+                return -EINVAL;
+        }
+        if (!spi_is_bpw_supported(spidev, drvdata->bits_per_word)) {
+                dev_warn(&spidev->dev, "Controller has no %u bit words, "
+                         "using 8\n", drvdata->bits_per_word);
+                drvdata->bits_per_word = 8;
+        }
+        DEV_DEBUG(&spidev->dev, "Frames in %u bit words on %u data lines\n",
+                  drvdata->bits_per_word, drvdata->rx_nbits);
+
+        if (rx_prebuilt) {
+                retval = rx_frames_prepare(drvdata);
+                if (retval) {
+                        dev_err(&spidev->dev, "Preparing SPI messages failed %d\n",
+                                retval);
+                        return retval;
+                }
+        }
+
+        /*
+         * Setup GPIO pins. BUSY belongs to the bus, shared with the other
+         * devices on the controller.
+        */
+        of_property_read_u32(spidev->dev.of_node, "mycomp,priority",
+                             &drvdata->priority);
+        retval = cdev_spi_bus_get(drvdata);
+        if (retval)
+                return retval;
+        retval = devm_add_action_or_reset(&spidev->dev, cdev_spi_bus_put,
+                                          drvdata);
+        if (retval)
+                return retval;
+
+        drvdata->ready = devm_gpiod_get(&spidev->dev, "mycomp,ready", GPIOD_IN);
+        if (IS_ERR(drvdata->ready)) {
+                dev_err(&spidev->dev, "gpiod_get failed for READY\n");
+                return PTR_ERR(drvdata->ready);
+        }
+
+        drvdata->irq = gpiod_to_irq(drvdata->ready);
+        if (drvdata->irq < 0) {
+                dev_err(&spidev->dev, "gpiod_to_irq failed for READY pin\n");
+                return drvdata->irq;
+        }
+        DEV_DEBUG(&spidev->dev, "GPIOD irq = %d.\n", drvdata->irq);
+
+        /* The handler may run as soon as the IRQ is requested */
+        spi_set_drvdata(spidev, drvdata);
+
+        /*
+         * Setup corresponding chardev.
+        */
+        retval = cdev_spi_register(drvdata);
+        if (retval)
+                return retval;
+
+        retval = request_threaded_irq(drvdata->irq,
+                                 top_ready_handler,
+                                 drvdata->rx_worker ? NULL : bottom_ready_handler,
+                                 IRQF_TRIGGER_RISING |
+                                 (drvdata->rx_worker ? 0 : IRQF_ONESHOT),
+                                 "spi-protocol-sample",
+                                 spidev);
+        if (retval) {
+                dev_err(&spidev->dev, "request_threaded_irq failed %d\n", retval);
+                cdev_spi_unregister(drvdata);
+                return retval;
+        }
+        if (drvdata->cpu >= 0) {
+                retval = irq_set_affinity_and_hint(drvdata->irq,
+                                                   cpumask_of(drvdata->cpu));
+                if (retval)
+                        dev_warn(&spidev->dev, "READY IRQ affinity not set %d\n",
+                                 retval);
+        }
+
+        drvdata->debugfs = debugfs_create_dir(dev_name(&spidev->dev),
+                                              cdev_spi_debugfs);
+        debugfs_create_file("latency", 0444, drvdata->debugfs, drvdata,
+                            &cdev_spi_latency_fops);
+        debugfs_create_file("record", 0400, drvdata->debugfs, drvdata,
+                            &cdev_spi_record_fops);
+        debugfs_create_file("replay", 0200, drvdata->debugfs, drvdata,
+                            &cdev_spi_replay_fops);
+
+        if (link_train ||
+            of_property_read_bool(spidev->dev.of_node, "mycomp,link-train"))
+                queue_work(system_long_wq, &drvdata->train_work);
+
+        DEBUG_DUMP_SPI_DEVICE(spidev);
+
+        DEV_DEBUG(&spidev->dev, "GPIOD part probed succesfully.\n");
+
+        return 0;
+};
+
+static void module_remove(struct spi_device *spidev) {
+        struct drvdata *drvdata = spi_get_drvdata(spidev);
+        if (!drvdata) {
+                dev_err(&spidev->dev, "Could not get driver data (remove).\n");
+                return;
+        }
+        /* Wake capture readers and writers so debugfs can go */
+        WRITE_ONCE(drvdata->capture_stop, true);
+        wake_up_interruptible(&drvdata->record_wait);
+        wake_up(&drvdata->replay_wait);
+        debugfs_remove_recursive(drvdata->debugfs);
+        mutex_lock(&drvdata->capture_lock);
+        rx_replay_stop(drvdata);
+        rx_record_stop(drvdata);
+        mutex_unlock(&drvdata->capture_lock);
+        cdev_spi_unregister(drvdata);
+        /* Training needs frames, stop it while they still come */
+        WRITE_ONCE(drvdata->train_cancel, true);
+        wake_up_interruptible(&drvdata->rx_wait);
+        cancel_work_sync(&drvdata->train_work);
+        cancel_work_sync(&drvdata->slow_work);
+        /* The rx_rt worker re-enables the IRQ, let it finish first */
+        disable_irq(drvdata->irq);
+        if (drvdata->rx_worker)
+                kthread_flush_work(&drvdata->rx_ready_work);
+        if (drvdata->cpu >= 0)
+                irq_update_affinity_hint(drvdata->irq, NULL);
+        free_irq(drvdata->irq, spidev);
+        /* No new frames after free_irq(). Let the queued ones finish */
+        wait_event(drvdata->rx_idle, rx_quiesced(drvdata));
+        flush_work(&drvdata->retry_work);
+        flush_work(&drvdata->rx_work);
+        /* The bus may go with this device, give BUSY back for good */
+        spin_lock_irq(&drvdata->rx_lock);
+        drvdata->throttle_high = 0;
+        rx_throttle_update(drvdata);
+        spin_unlock_irq(&drvdata->rx_lock);
+        cancel_delayed_work_sync(&drvdata->throttle_work);
+        /* Readers still holding the device get -ENODEV once drained */
+        WRITE_ONCE(drvdata->removed, true);
+        wake_up_interruptible(&drvdata->rx_wait);
+        wake_up_interruptible(&drvdata->tx_wait);
+        DEV_DEBUG(&spidev->dev, "module remove\n");
+};
+
+static const struct of_device_id spi_dt_ids[] = {
+        {
+                .compatible = "mycomp,cdev-spi-device",
+        },
+        { /* sentinel */ }
+};
+
+static struct spi_driver spi_driver = {
+        .probe = module_probe,
+        .remove = module_remove,
+        .driver = {
+                .name = "cdev-spi-sample",
+                .of_match_table = of_match_ptr(spi_dt_ids),
+                .owner = THIS_MODULE,
+                .dev_groups = cdev_spi_groups,
+        },
+};
+
+static int __init spi_module_init(void)
+{
+        int i;
+        int retval;
+
+        pr_info("%s: module init\n", CDEV_SPI_MODULE);
+
+        /* With rx_header the command must fit in the header transfer */
+        BUILD_BUG_ON(sizeof(struct cdev_spi_cmd) >
+                     sizeof(struct cdev_spi_frame_hdr));
+
+        if (rx_frames < 2 || rx_frames > CDEV_SPI_RX_MAX_FRAMES ||
+            !is_power_of_2(rx_frames)) {
+                pr_err("%s: rx_frames must be a power of 2, 2 to %d\n",
+                       CDEV_SPI_MODULE, CDEV_SPI_RX_MAX_FRAMES);
+                return -EINVAL;
+        }
+
+        if (rx_throttle_high > 100 ||
+            (rx_throttle_high && rx_throttle_low >= rx_throttle_high)) {
+                pr_err("%s: rx_throttle_low must be below rx_throttle_high, "
+                       "up to 100\n", CDEV_SPI_MODULE);
+                return -EINVAL;
+        }
+
+        if (!bus_depth) {
+                pr_err("%s: bus_depth must be at least 1\n", CDEV_SPI_MODULE);
+                return -EINVAL;
+        }
+
+        if (!rx_chunks || rx_chunks > CDEV_SPI_RX_MAX_CHUNKS ||
+            (rx_header && rx_chunks > 1)) {
+                pr_err("%s: rx_chunks must be 1 to %d, and 1 with rx_header\n",
+                       CDEV_SPI_MODULE, CDEV_SPI_RX_MAX_CHUNKS);
+                return -EINVAL;
+        }
+
+        for (i = 0; i < ARRAY_SIZE(crc_variants); i++)
+                if (sysfs_streq(crc, crc_variants[i].name))
+                        crc_variant = &crc_variants[i];
+        if (!crc_variant) {
+                pr_err("%s: unknown crc variant %s\n", CDEV_SPI_MODULE, crc);
+                return -EINVAL;
+        }
+#ifdef CONFIG_ARM64
+        if (crc_variant->le && cpus_have_cap(ARM64_HAS_CRC32))
+                pr_info("%s: crc32_le uses the CPU CRC32 instructions\n",
+                        CDEV_SPI_MODULE);
+#endif
+
+        retval = alloc_chrdev_region(&devno, 0, CDEV_SPI_DEVNO_MINORS,
+                                     CDEV_SPI_DEVNO_NAME);
+        if (retval)
+                return retval;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+        cdev_spi_class = class_create(CDEV_SPI_CLASS);
+#else
+        cdev_spi_class = class_create(THIS_MODULE, CDEV_SPI_CLASS);
+#endif
+        if (IS_ERR(cdev_spi_class)) {
+                retval = PTR_ERR(cdev_spi_class);
+                goto err_region;
+        }
+
+        /* Ordered, so re-reads never hold a shared system workqueue */
+        cdev_spi_retry_wq = alloc_ordered_workqueue("cdev_spi_retry",
+                                                    WQ_HIGHPRI);
+        if (!cdev_spi_retry_wq) {
+                retval = -ENOMEM;
+                goto err_class;
+        }
+
+        cdev_spi_debugfs = debugfs_create_dir(CDEV_SPI_DEVNO_NAME, NULL);
+
+        /* Register spi driver */
+        retval = spi_register_driver(&spi_driver);
+        if (retval)
+                goto err_wq;
+        return 0;
+
+err_wq:
+        debugfs_remove_recursive(cdev_spi_debugfs);
+        destroy_workqueue(cdev_spi_retry_wq);
+err_class:
+        class_destroy(cdev_spi_class);
+err_region:
+        unregister_chrdev_region(devno, CDEV_SPI_DEVNO_MINORS);
+        return retval;
+}
+
+static void __exit spi_module_exit(void)
+{
+        spi_unregister_driver(&spi_driver);
+        debugfs_remove_recursive(cdev_spi_debugfs);
+        destroy_workqueue(cdev_spi_retry_wq);
+        class_destroy(cdev_spi_class);
+        unregister_chrdev_region(devno, CDEV_SPI_DEVNO_MINORS);
+        pr_info("%s: module exit\n", CDEV_SPI_MODULE);
+}
+
+module_init(spi_module_init);
+module_exit(spi_module_exit);
+
+MODULE_AUTHOR("Niels Prösch, <niels.h.prosch@gmail.com>");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,465 @@
+/*
+ * User space reader for /dev/cdev_spi<N>.
+ *
+ * Reads frames either with read() into a local buffer or zero-copy from
+ * the mmap()ed frame ring, or many frames per call with
+ * CDEV_SPI_IOC_RECV_BATCH, and reports throughput and CPU time so the
+ * paths can be compared. Frame metadata gives frames dropped and the
+ * latency from the READY interrupt to the frame reaching this process.
+ *
+ * With -o the records (slot, then payload) are captured to a file, with
+ * read() and write() or, with -s, spliced through a pipe without passing
+ * through this process. -S splices them into a local stream socket
+ * instead, drained by a child that checks the records arrive intact.
+ *
+ *   cdev-spi-reader [-m | -b batch | -s | -S] [-o file] [-n frames]
+ *                   [-t seconds] [device]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "cdev-spi-sample.h"
+
+struct stats {
+        unsigned long frames;
+        unsigned long errors;
+        unsigned long long bytes;
+        unsigned long long dropped;
+        double lat_sum, lat_max;         /* READY interrupt to consume(), ns */
+        uint32_t sum;                    /* Touch the data like a consumer */
+};
+
+static double now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void) {
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+               ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* buf NULL only accounts for the frame, as a recorder does not look at it */
+static void consume(struct stats *st, const struct cdev_spi_slot *slot,
+                    const uint8_t *buf, size_t len) {
+        size_t i;
+        double lat = now() * 1e9 - slot->irq_ns;
+
+        for (i = 0; buf && i < len; i += 64)
+                st->sum += buf[i];
+        st->frames++;
+        st->bytes += len;
+        st->dropped += slot->dropped;
+        st->lat_sum += lat;
+        if (lat > st->lat_max)
+                st->lat_max = lat;
+}
+
+/* Record from read() or RECV_BATCH with metadata on: slot, then payload */
+static void consume_record(struct stats *st, const uint8_t *buf, size_t len) {
+        struct cdev_spi_slot slot;
+
+        if (len < sizeof(slot)) {
+                st->errors++;
+                return;
+        }
+        /* Records in a batch are packed, so the slot may be unaligned */
+        memcpy(&slot, buf, sizeof(slot));
+        consume(st, &slot, buf + sizeof(slot), len - sizeof(slot));
+}
+
+static int wait_readable(int fd) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, 1000) < 0)
+                return -errno;
+        if (pfd.revents & (POLLERR | POLLHUP))
+                return -ENODEV;
+        return 0;
+}
+
+static int write_all(int out, const uint8_t *buf, size_t len) {
+        ssize_t n;
+
+        while (len) {
+                n = write(out, buf, len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                }
+                buf += n;
+                len -= n;
+        }
+        return 0;
+}
+
+static int run_read(int fd, int out, struct stats *st, unsigned long n,
+                    double end) {
+        int ret;
+        ssize_t len;
+        struct cdev_spi_slot slot;
+        static uint8_t buf[(1 << 20) + sizeof(struct cdev_spi_slot)];
+
+        while (st->frames < n && now() < end) {
+                len = read(fd, buf, sizeof(buf));
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                }
+                if (out < 0) {
+                        consume_record(st, buf, len);
+                        continue;
+                }
+                ret = write_all(out, buf, len);
+                if (ret)
+                        return ret;
+                if (len < (ssize_t) sizeof(slot)) {
+                        st->errors++;
+                        continue;
+                }
+                memcpy(&slot, buf, sizeof(slot));
+                consume(st, &slot, NULL, len - sizeof(slot));
+        }
+        return 0;
+}
+
+/*
+ * Capture with splice(): device to pipe and pipe to file, the frame pages
+ * never come to user space. Records are not seen here either, so frames
+ * are counted from the bytes, exact for frames of frame_size.
+ */
+static int run_splice(int fd, int out, struct stats *st, unsigned long n,
+                      double end) {
+        int ret = 0;
+        int p[2];
+        ssize_t len, moved;
+        size_t record;
+        struct cdev_spi_ring *ring;
+        unsigned long long bytes = 0;
+
+        ring = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+        if (ring == MAP_FAILED)
+                return -errno;
+        record = sizeof(struct cdev_spi_slot) + ring->frame_size;
+        munmap(ring, getpagesize());
+
+        if (pipe(p) < 0)
+                return -errno;
+        /* Room for a few whole frames; the pipe limit may cut it */
+        fcntl(p[1], F_SETPIPE_SZ, 4 * record);
+
+        while (st->frames < n && now() < end) {
+                len = splice(fd, NULL, p[1], NULL, 1 << 20, SPLICE_F_MOVE);
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        ret = -errno;
+                        break;
+                }
+                while (len) {
+                        moved = splice(p[0], NULL, out, NULL, len, SPLICE_F_MOVE);
+                        if (moved < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                ret = -errno;
+                                goto out;
+                        }
+                        len -= moved;
+                        bytes += moved;
+                }
+                st->frames = bytes / record;
+                st->bytes = st->frames * (record - sizeof(struct cdev_spi_slot));
+        }
+out:
+        close(p[0]);
+        close(p[1]);
+        return ret;
+}
+
+/*
+ * Other end of the -S socket. Reads records as they come and checks
+ * frame numbers only go up: spliced data still queued in the socket must
+ * not change when the device reuses the slot it came from. Pauses now
+ * and then, so frames sit queued in the socket while the device moves on.
+ */
+static int sink_socket(int sock) {
+        ssize_t n;
+        size_t have = 0;
+        unsigned long records = 0, bad = 0;
+        uint32_t last = 0;
+        struct cdev_spi_slot slot;
+        static uint8_t buf[1 << 22];
+
+        for (;;) {
+                n = read(sock, buf + have, sizeof(buf) - have);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        break;
+                have += n;
+                while (have >= sizeof(slot)) {
+                        memcpy(&slot, buf, sizeof(slot));
+                        if (slot.len > sizeof(buf) - sizeof(slot)) {
+                                fprintf(stderr, "socket: bad record\n");
+                                return 1;
+                        }
+                        if (have < sizeof(slot) + slot.len)
+                                break;
+                        if (slot.status != CDEV_SPI_SLOT_OK ||
+                            (records && (int32_t) (slot.frame - last) <= 0))
+                                bad++;
+                        last = slot.frame;
+                        records++;
+                        have -= sizeof(slot) + slot.len;
+                        memmove(buf, buf + sizeof(slot) + slot.len, have);
+                        if (!(records % 64))
+                                usleep(10000);
+                }
+        }
+        printf("  socket: %lu records, %lu out of order or bad\n", records,
+               bad);
+        return bad || have ? 1 : 0;
+}
+
+static int run_batch(int fd, struct stats *st, unsigned long n, double end,
+                     unsigned int batch) {
+        int ret = 0;
+        int i;
+        static uint8_t buf[1 << 22];
+        struct cdev_spi_frame_desc *descs;
+        struct cdev_spi_batch req = {
+                .buf = (uintptr_t) buf,
+                .buf_len = sizeof(buf),
+                .max_frames = batch,
+                .min_frames = batch,
+                .timeout_ms = 1000,
+        };
+
+        descs = calloc(batch, sizeof(*descs));
+        if (!descs)
+                return -ENOMEM;
+        req.descs = (uintptr_t) descs;
+
+        while (st->frames < n && now() < end) {
+                ret = ioctl(fd, CDEV_SPI_IOC_RECV_BATCH, &req);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        ret = -errno;
+                        break;
+                }
+                for (i = 0; i < ret; i++)
+                        consume_record(st, buf + descs[i].offset,
+                                       descs[i].len);
+                ret = 0;
+        }
+
+        free(descs);
+        return ret;
+}
+
+static int run_mmap(int fd, struct stats *st, unsigned long n, double end) {
+        int retval = 0;
+        size_t size;
+        uint32_t head, tail;
+        struct cdev_spi_ring hdr, *ring;
+        uint8_t *base;
+
+        /* Geometry is in the header page */
+        ring = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+        if (ring == MAP_FAILED)
+                return -errno;
+        hdr = *ring;
+        munmap(ring, getpagesize());
+
+        size = hdr.data_offset + (size_t) hdr.nr_slots * hdr.slot_size;
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+                return -errno;
+        ring = (struct cdev_spi_ring *) base;
+
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        while (st->frames < n && now() < end) {
+                head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+                if (head == tail) {
+                        retval = wait_readable(fd);
+                        if (retval)
+                                break;
+                        continue;
+                }
+                for (; tail != head; tail++) {
+                        struct cdev_spi_slot *slot =
+                                &ring->slot[tail & (ring->nr_slots - 1)];
+
+                        if (slot->status == CDEV_SPI_SLOT_FILTERED)
+                                continue;
+                        if (slot->status != CDEV_SPI_SLOT_OK) {
+                                st->errors++;
+                                continue;
+                        }
+                        consume(st, slot, base + ring->data_offset +
+                                (size_t) (tail & (ring->nr_slots - 1)) *
+                                ring->slot_size, slot->len);
+                }
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        munmap(base, size);
+        return retval;
+}
+
+int main(int argc, char **argv) {
+        int c;
+        int fd;
+        int out = -1;
+        int retval;
+        int use_mmap = 0;
+        int use_splice = 0;
+        int use_socket = 0;
+        int sv[2];
+        int status;
+        pid_t sink = -1;
+        uint32_t meta = 1;
+        unsigned int batch = 0;
+        unsigned long n = ~0UL;
+        double secs = 10;
+        double t0, c0, t, cpu;
+        const char *path = "/dev/cdev_spi0";
+        const char *out_path = NULL;
+        const char *mode;
+        struct stats st = { 0 };
+
+        while ((c = getopt(argc, argv, "b:mn:o:sSt:")) != -1) {
+                switch (c) {
+                case 'b':
+                        batch = strtoul(optarg, NULL, 0);
+                        break;
+                case 'm':
+                        use_mmap = 1;
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 'o':
+                        out_path = optarg;
+                        break;
+                case 's':
+                        use_splice = 1;
+                        break;
+                case 'S':
+                        use_splice = use_socket = 1;
+                        break;
+                case 't':
+                        secs = atof(optarg);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-m | -b batch | -s | -S] "
+                                "[-o file] [-n frames] [-t seconds] [device]\n",
+                                argv[0]);
+                        return 2;
+                }
+        }
+        if (optind < argc)
+                path = argv[optind];
+        if ((use_splice && !out_path && !use_socket) ||
+            (out_path && (use_mmap || batch || use_socket))) {
+                fprintf(stderr, "-o goes with read() or -s, -s needs -o, "
+                        "-S takes none\n");
+                return 2;
+        }
+        if (use_socket) {
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+                        perror("socketpair");
+                        return 1;
+                }
+                sink = fork();
+                if (sink < 0) {
+                        perror("fork");
+                        return 1;
+                }
+                if (!sink) {
+                        close(sv[0]);
+                        return sink_socket(sv[1]);
+                }
+                close(sv[1]);
+                out = sv[0];
+        }
+        if (out_path) {
+                out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (out < 0) {
+                        perror(out_path);
+                        return 1;
+                }
+        }
+
+        /* The consumer writes ring->tail, so mmap mode needs a writable fd */
+        fd = open(path, use_mmap ? O_RDWR : O_RDONLY);
+        if (fd < 0) {
+                perror(path);
+                return 1;
+        }
+
+        if (!use_mmap && ioctl(fd, CDEV_SPI_IOC_SET_META, &meta) < 0) {
+                perror("CDEV_SPI_IOC_SET_META");
+                return 1;
+        }
+
+        t0 = now();
+        c0 = cpu_time();
+        if (use_mmap)
+                retval = run_mmap(fd, &st, n, t0 + secs);
+        else if (batch)
+                retval = run_batch(fd, &st, n, t0 + secs, batch);
+        else if (use_splice)
+                retval = run_splice(fd, out, &st, n, t0 + secs);
+        else
+                retval = run_read(fd, out, &st, n, t0 + secs);
+        t = now() - t0;
+        cpu = cpu_time() - c0;
+        close(fd);
+        if (out >= 0)
+                close(out);
+        /* The sink reads to EOF, then reports */
+        if (sink > 0 && (waitpid(sink, &status, 0) < 0 ||
+                         !WIFEXITED(status) || WEXITSTATUS(status)))
+                retval = retval ? retval : -EIO;
+
+        if (retval)
+                fprintf(stderr, "%s: %s\n", path, strerror(-retval));
+
+        mode = use_mmap ? "mmap" : batch ? "batch" :
+               use_socket ? "splice+socket" : use_splice ? "splice" :
+               out_path ? "read+write" : "read";
+        printf("mode %s: %lu frames (%lu bad) %llu bytes in %.2f s\n",
+               mode, st.frames, st.errors, st.bytes, t);
+        printf("  %.1f frames/s, %.2f MB/s, cpu %.3f s (%.1f us/frame)\n",
+               st.frames / t, st.bytes / t / 1e6, cpu,
+               st.frames ? cpu * 1e6 / st.frames : 0.0);
+        /* Spliced records never reach this process */
+        if (!use_splice)
+                printf("  %llu dropped, READY to reader avg %.1f us, max %.1f us\n",
+                       st.dropped, st.frames ? st.lat_sum / st.frames / 1e3 : 0.0,
+                       st.lat_max / 1e3);
+
+        return retval ? 1 : 0;
+}
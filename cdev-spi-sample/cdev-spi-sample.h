@@ -0,0 +1,234 @@
+/*
+ * Interface of the cdev-spi-sample character device.
+ * Shared by the kernel module and user space.
+ */
+#ifndef CDEV_SPI_SAMPLE_H
+#define CDEV_SPI_SAMPLE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Shared frame ring, mapped with mmap() on /dev/cdev_spi<N>.
+ *
+ * Offset 0 is this header, with a struct cdev_spi_slot per slot, padded to
+ * whole pages. Frame slots start at data_offset and are slot_size apart.
+ * Slot i holds frame number i modulo nr_slots.
+ *
+ * head is written by the driver only: frames before head are complete and
+ * slot[] describes them. tail is written by the consumer: frames before
+ * tail are handed back to the driver. Both are free running counters.
+ * Read head with acquire semantics and write tail with release semantics.
+ * read() on the same device consumes from the same ring and moves tail too.
+ *
+ * Times are CLOCK_MONOTONIC ns, as clock_gettime() gives in user space.
+ * frame counts every frame the driver received, so a slot with status
+ * CDEV_SPI_SLOT_ERROR or CDEV_SPI_SLOT_FILTERED (skipped by read()) shows as
+ * a gap there. dropped counts frames that never made it into a slot: READY
+ * edges while all slots were taken, plus frames the device reports lost by
+ * its header seq.
+ */
+#define CDEV_SPI_SLOT_OK         0       /* Frame received and CRC ok */
+#define CDEV_SPI_SLOT_ERROR      1       /* SPI or CRC error. Skip it */
+#define CDEV_SPI_SLOT_FILTERED   2       /* Dropped by the frame filter. Skip it */
+
+struct cdev_spi_slot {
+        __u32 status;                    /* CDEV_SPI_SLOT_* */
+        __u32 len;                       /* Payload bytes in the slot */
+        __u16 seq;                       /* From the frame header, else frame */
+        __u16 flags;                     /* From the frame header, else 0 */
+        __u32 frame;                     /* Frame number on this device */
+        __u64 irq_ns;                    /* READY interrupt */
+        __u64 start_ns;                  /* SPI transfer started */
+        __u64 end_ns;                    /* SPI transfer completed */
+        __u32 dropped;                   /* Frames lost since the previous slot */
+        __u32 reserved;
+};
+
+struct cdev_spi_ring {
+        __u32 head;
+        __u32 pad0[15];                  /* head and tail on own cache lines */
+        __u32 tail;
+        __u32 pad1[15];
+        __u32 nr_slots;                  /* Power of 2 */
+        __u32 slot_size;
+        __u32 frame_size;                /* Max payload bytes per frame */
+        __u32 data_offset;               /* Offset of slot 0 in the mapping */
+        struct cdev_spi_slot slot[];
+};
+
+/*
+ * Frame header, sent by the device ahead of each frame when the module is
+ * loaded with rx_header=1. Little endian. len payload bytes follow, then
+ * the CRC32 of the payload. seq counts frames on the device, so gaps show
+ * frames it had to drop.
+ */
+#define CDEV_SPI_HDR_MAGIC       0xa5
+
+struct cdev_spi_frame_hdr {
+        __u8 magic;                      /* CDEV_SPI_HDR_MAGIC */
+        __u8 flags;
+        __le16 seq;
+        __le32 len;                      /* Payload bytes, CRC not included */
+};
+
+/*
+ * Outbound command, clocked out on MOSI in the first bytes of a frame (with
+ * the header when rx_header=1) while the frame comes in on MISO. Queue
+ * commands with write() of whole entries or CDEV_SPI_IOC_SEND_CMD. A frame
+ * with no command queued sends all zeros, CDEV_SPI_CMD_NOP. Little endian.
+ * The types below are a suggestion; the driver passes any type through.
+ */
+#define CDEV_SPI_CMD_NOP         0
+#define CDEV_SPI_CMD_ACK         1       /* Frame seq received */
+#define CDEV_SPI_CMD_RETRANSMIT  2       /* Send frame seq again */
+#define CDEV_SPI_CMD_CONFIG      3       /* Set device register seq to arg */
+
+struct cdev_spi_cmd {
+        __u8 type;                       /* CDEV_SPI_CMD_* */
+        __u8 flags;
+        __le16 seq;
+        __le32 arg;
+};
+
+#define CDEV_SPI_IOC_MAGIC       0xc5
+#define CDEV_SPI_IOC_SEND_CMD    _IOW(CDEV_SPI_IOC_MAGIC, 1, struct cdev_spi_cmd)
+#define CDEV_SPI_IOC_FLUSH_CMDS  _IO(CDEV_SPI_IOC_MAGIC, 2)
+
+/*
+ * Batched dequeue, CDEV_SPI_IOC_RECV_BATCH. Waits until min_frames frames
+ * are queued or timeout_ms passed (-1 waits forever, O_NONBLOCK not at
+ * all), then copies up to max_frames payloads back to back into buf and
+ * describes each in descs[]. Returns the number of frames, also stored in
+ * nr_frames; 0 after a timeout with nothing queued.
+ */
+struct cdev_spi_frame_desc {
+        __u32 offset;                    /* Payload (or metadata) offset in buf */
+        __u32 len;                       /* Including the metadata, if on */
+        __u16 seq;
+        __u16 flags;
+        __u32 reserved;
+};
+
+struct cdev_spi_batch {
+        __u64 descs;                     /* struct cdev_spi_frame_desc[max_frames] */
+        __u64 buf;
+        __u32 buf_len;
+        __u32 max_frames;
+        __u32 min_frames;
+        __s32 timeout_ms;
+        __u32 nr_frames;                 /* Out */
+        __u32 reserved;
+};
+
+#define CDEV_SPI_IOC_RECV_BATCH  _IOWR(CDEV_SPI_IOC_MAGIC, 3, struct cdev_spi_batch)
+
+/*
+ * Frame metadata on read(). After CDEV_SPI_IOC_SET_META with a non-zero
+ * value, each frame read() on this file is its struct cdev_spi_slot
+ * followed by the payload, and RECV_BATCH copies the same records.
+ */
+#define CDEV_SPI_IOC_SET_META    _IOW(CDEV_SPI_IOC_MAGIC, 4, __u32)
+
+/*
+ * Sample conversion, set per device with CDEV_SPI_IOC_SET_CONVERT or the
+ * convert attribute in sysfs. Runs on each frame right after the CRC
+ * check, in place in its slot, so read(), RECV_BATCH and the mapping all
+ * see converted samples and slot len is the converted length. Slots are
+ * sized for the 4/3 growth of unpacking.
+ *
+ * Input samples are MSB first, unless CDEV_SPI_CONV_LE, in the bytes as
+ * sent: with rx_bits_per_word 16 or 32 the word order the SPI core left is
+ * taken into account. Output samples are 16 or 32 bit in CPU byte order. decimate keeps the first of every
+ * decimate groups of channels interleaved samples, without filtering.
+ * Bytes after the last whole input sample are dropped.
+ */
+#define CDEV_SPI_CONV_NONE       0       /* Payload as received */
+#define CDEV_SPI_CONV_16         1       /* 16 bit samples */
+#define CDEV_SPI_CONV_32         2       /* 32 bit samples */
+#define CDEV_SPI_CONV_PACKED24   3       /* Packed 24 bit samples to 32 bit */
+#define CDEV_SPI_CONV_PACKED12   4       /* 12 bit sample pairs in 3 bytes to 16 bit */
+
+#define CDEV_SPI_CONV_LE         0x1     /* Input least significant byte first */
+#define CDEV_SPI_CONV_SIGNED     0x2     /* Sign extend packed samples */
+
+struct cdev_spi_convert {
+        __u32 format;                    /* CDEV_SPI_CONV_* */
+        __u32 flags;                     /* CDEV_SPI_CONV_LE, _SIGNED */
+        __u32 decimate;                  /* 0 or 1 keeps every sample */
+        __u32 channels;                  /* Samples per group, 0 is 1 */
+};
+
+#define CDEV_SPI_IOC_SET_CONVERT _IOW(CDEV_SPI_IOC_MAGIC, 5, struct cdev_spi_convert)
+#define CDEV_SPI_IOC_GET_CONVERT _IOR(CDEV_SPI_IOC_MAGIC, 6, struct cdev_spi_convert)
+
+/*
+ * Frame filter, per device. Runs on each frame that passed the CRC check,
+ * before conversion. A dropped frame still takes its slot, with status
+ * CDEV_SPI_SLOT_FILTERED, but read(), RECV_BATCH and splice() pass over it,
+ * and poll() only reports POLLIN for frames they return (files that map
+ * the slots see every slot). Readers are only woken for those frames, or
+ * once dropped frames fill half the ring. A kept frame may be cut to its
+ * first bytes.
+ *
+ * Fixed function, CDEV_SPI_IOC_SET_FILTER: the 32 bit word at offset (CPU
+ * byte order), and-ed with mask, is compared with value, and frames are
+ * dropped on a match (DROP_MATCH) or on no match (KEEP_MATCH). A frame too
+ * short for the word does not match. DROP_REPEAT drops frames with the same
+ * length and CRC as the frame before. slice cuts kept frames to as many
+ * payload bytes.
+ *
+ * Classic BPF, CDEV_SPI_IOC_ATTACH_BPF: struct sock_filter instructions as
+ * for SO_ATTACH_FILTER, run on the payload. ld [k] loads the 32 bit word at
+ * byte offset k, a multiple of 4 within the frame size, in CPU byte order.
+ * Bytes at or past the length of a short frame read as 0. Other loads from
+ * the packet (ldh, ldb, ld len, indirect, ancillary) are refused. The
+ * return value is the bytes to deliver and 0 drops the frame, as for
+ * sockets. With both set, a frame must pass both.
+ */
+#define CDEV_SPI_FILTER_DROP_MATCH  0x1  /* Drop frames whose word matches */
+#define CDEV_SPI_FILTER_KEEP_MATCH  0x2  /* Drop frames whose word does not */
+#define CDEV_SPI_FILTER_DROP_REPEAT 0x4  /* Drop frames equal to the one before */
+
+struct cdev_spi_filter {
+        __u32 flags;                     /* CDEV_SPI_FILTER_*, 0 keeps all */
+        __u32 offset;                    /* Of the word matched, multiple of 4 */
+        __u32 mask;
+        __u32 value;
+        __u32 slice;                     /* Payload bytes kept, 0 all */
+        __u32 reserved;
+};
+
+struct cdev_spi_bpf {
+        __u64 insns;                     /* struct sock_filter[len] */
+        __u32 len;
+        __u32 reserved;
+};
+
+#define CDEV_SPI_IOC_SET_FILTER  _IOW(CDEV_SPI_IOC_MAGIC, 7, struct cdev_spi_filter)
+#define CDEV_SPI_IOC_GET_FILTER  _IOR(CDEV_SPI_IOC_MAGIC, 8, struct cdev_spi_filter)
+#define CDEV_SPI_IOC_ATTACH_BPF  _IOW(CDEV_SPI_IOC_MAGIC, 9, struct cdev_spi_bpf)
+#define CDEV_SPI_IOC_DETACH_BPF  _IO(CDEV_SPI_IOC_MAGIC, 10)
+
+/*
+ * Raw frame capture, read from debugfs cdev_spi/<spi dev>/record and written
+ * back to .../replay. Each frame is this record followed by len bytes of
+ * payload and CRC as the controller left them, before the CRC check and
+ * conversion, in the word order of rx_bits_per_word. len is 0 for frames
+ * whose transfer failed. Host byte order; replay on the machine and module
+ * parameters the capture was taken with.
+ */
+#define CDEV_SPI_CAPTURE_MAGIC   0x43505343      /* "CSPC" */
+#define CDEV_SPI_CAPTURE_HDR     0x1     /* hdr holds the rx_header header */
+
+struct cdev_spi_capture {
+        __u32 magic;                     /* CDEV_SPI_CAPTURE_MAGIC */
+        __u32 len;                       /* Bytes that follow */
+        __u64 irq_ns;                    /* READY interrupt */
+        __u64 xfer_ns;                   /* SPI transfer time */
+        __s32 status;                    /* Transfer result, -EPROTO bad header */
+        __u32 flags;                     /* CDEV_SPI_CAPTURE_* */
+        struct cdev_spi_frame_hdr hdr;
+};
+
+#endif /* CDEV_SPI_SAMPLE_H */
@@ -0,0 +1,113 @@
+/*
+ * Tracepoints of the cdev-spi-sample receive path.
+ *
+ * One event per stage of a frame, keyed by device minor and frame number:
+ *   cdev_spi_ready   READY interrupt taken
+ *   cdev_spi_start   SPI transfer submitted
+ *   cdev_spi_done    SPI transfer completed
+ *   cdev_spi_crc     CRC checked, frame queued for the reader
+ *   cdev_spi_dequeue frame consumed by read()
+ *
+ *   echo 1 > /sys/kernel/tracing/events/cdev_spi/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cdev_spi
+
+#if !defined(_CDEV_SPI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CDEV_SPI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(cdev_spi_ready,
+        TP_PROTO(int minor, int level),
+        TP_ARGS(minor, level),
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(int, level)
+        ),
+        TP_fast_assign(
+                __entry->minor = minor;
+                __entry->level = level;
+        ),
+        TP_printk("minor=%d ready=%d", __entry->minor, __entry->level)
+);
+
+TRACE_EVENT(cdev_spi_start,
+        TP_PROTO(int minor, unsigned int seq, u64 irq_ns),
+        TP_ARGS(minor, seq, irq_ns),
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(unsigned int, seq)
+                __field(u64, irq_ns)
+        ),
+        TP_fast_assign(
+                __entry->minor = minor;
+                __entry->seq = seq;
+                __entry->irq_ns = irq_ns;
+        ),
+        TP_printk("minor=%d seq=%u irq_to_start=%llu ns", __entry->minor,
+                  __entry->seq, __entry->irq_ns)
+);
+
+TRACE_EVENT(cdev_spi_done,
+        TP_PROTO(int minor, unsigned int seq, int status, u64 xfer_ns),
+        TP_ARGS(minor, seq, status, xfer_ns),
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(unsigned int, seq)
+                __field(int, status)
+                __field(u64, xfer_ns)
+        ),
+        TP_fast_assign(
+                __entry->minor = minor;
+                __entry->seq = seq;
+                __entry->status = status;
+                __entry->xfer_ns = xfer_ns;
+        ),
+        TP_printk("minor=%d seq=%u status=%d xfer=%llu ns", __entry->minor,
+                  __entry->seq, __entry->status, __entry->xfer_ns)
+);
+
+TRACE_EVENT(cdev_spi_crc,
+        TP_PROTO(int minor, unsigned int seq, bool valid, u64 crc_ns),
+        TP_ARGS(minor, seq, valid, crc_ns),
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(unsigned int, seq)
+                __field(bool, valid)
+                __field(u64, crc_ns)
+        ),
+        TP_fast_assign(
+                __entry->minor = minor;
+                __entry->seq = seq;
+                __entry->valid = valid;
+                __entry->crc_ns = crc_ns;
+        ),
+        TP_printk("minor=%d seq=%u valid=%d crc=%llu ns", __entry->minor,
+                  __entry->seq, __entry->valid, __entry->crc_ns)
+);
+
+TRACE_EVENT(cdev_spi_dequeue,
+        TP_PROTO(int minor, unsigned int seq, size_t len),
+        TP_ARGS(minor, seq, len),
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(unsigned int, seq)
+                __field(size_t, len)
+        ),
+        TP_fast_assign(
+                __entry->minor = minor;
+                __entry->seq = seq;
+                __entry->len = len;
+        ),
+        TP_printk("minor=%d seq=%u len=%zu", __entry->minor, __entry->seq,
+                  __entry->len)
+);
+
+#endif /* _CDEV_SPI_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cdev-spi-trace
+#include <trace/define_trace.h>
@@ -9,21 +9,114 @@
 #include <linux/err.h>
 #include <linux/crc32.h>
 #include <linux/timekeeping.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 #define SPI_MODULE      "spi-protocol-device"
 #define RX_BUFFER_SIZE  10*1024*4
+#define RX_MAX_FRAMES   256
+
+static bool rx_async = true;
+module_param(rx_async, bool, 0444);
+MODULE_PARM_DESC(rx_async, "Receive with spi_async() into rotating frame buffers "
+                 "(default true). When false get_block_sync() is used.");
+
+static unsigned int rx_frames = 16;
+module_param(rx_frames, uint, 0444);
+MODULE_PARM_DESC(rx_frames, "Frames in flight or waiting for the CRC check "
+                 "per device. Power of 2, 2 to 256 (default 16)");
+
+static unsigned int rx_pool_frames = 32;
+module_param(rx_pool_frames, uint, 0444);
+MODULE_PARM_DESC(rx_pool_frames, "Frame buffers in the pool shared by all "
+                 "devices, at least one per device (default 32)");
+
+static unsigned int rx_bits_per_word;
+module_param(rx_bits_per_word, uint, 0444);
+MODULE_PARM_DESC(rx_bits_per_word, "SPI word size of frame transfers, 8, 16 "
+                 "or 32. Default DT spi-bits-per-word per device, else 8. "
+                 "Falls back to 8 when the controller cannot");
+
+struct _drvdata_t;
+
+/**
+ * @brief Frame buffers shared by all devices
+ *
+ * Each buffer is vmalloc()ed, so it is made of order-0 pages and never
+ * needs a high-order allocation, however fragmented memory is. The SPI
+ * core maps vmalloc buffers for DMA as a scatterlist, one entry per page.
+ * Allocated at module init; a device takes a buffer per frame on the
+ * READY edge and gives it back after the CRC check, so idle devices hold
+ * none. bufs[0..nr_free) are the free ones.
+ *
+ * Each bound device has one buffer reserved while it holds none, so a
+ * backed up device cannot starve the others: beyond its first buffer a
+ * device only gets one while more than reserved are free. Probe grows
+ * the pool when there would be more devices than buffers.
+ */
+static struct {
+        spinlock_t lock;
+        u8 **bufs;
+        unsigned int nr_free;
+        unsigned int size;               /* Buffers, free or not */
+        unsigned int nr_devices;         /* Bound devices, rx_pool_mutex */
+        unsigned int reserved;           /* Devices holding no buffer */
+} rx_pool = {
+        .lock = __SPIN_LOCK_UNLOCKED(rx_pool.lock),
+};
+static DEFINE_MUTEX(rx_pool_mutex);      /* Serializes growing the pool */
+
+/**
+ * @brief One receive frame and the SPI message filling it
+ */
+typedef struct _rx_frame_t {
+        struct _drvdata_t *drvdata;      /* Owning device */
+        u8 *rx_data;                     /* From rx_pool while in use */
+        int status;                      /* Result of the SPI transfer */
+        struct spi_message msg;
+        struct spi_transfer xfer;
+} rx_frame_t;
 
 /**
  * @brief Structure for holding device state across driver callbacks
+ *
+ * Frames rotate through frames[] by three free running counters:
+ * rx_submit (frames handed to the SPI core), rx_done (frames completed by
+ * the controller) and rx_tail (frames checked and released again).
+ * rx_submit and rx_done are protected by rx_lock. rx_tail is only written
+ * by rx_work.
  */
 typedef struct _drvdata_t {
+        struct spi_device *spidev;
         int irq;                         /* IRQ for ready pin */
         struct gpio_desc *ready,         /* Input. Raised when data is ready */
                          *busy;          /* Output. Raised by when busy */
-        u8 *rx_data;                     /* Data buffer for receiving */
+        u32 bits_per_word;               /* Of the frame transfers */
+        u8 rx_nbits;                     /* Data lines, from spi-rx-bus-width */
+        unsigned int pool_used;          /* Buffers taken, rx_pool.lock */
+        rx_frame_t *frames;              /* rx_frames entries */
+        spinlock_t rx_lock;
+        unsigned int rx_submit;
+        unsigned int rx_done;
+        unsigned int rx_tail;
+        struct work_struct rx_work;      /* CRC check of completed frames */
+        wait_queue_head_t rx_idle;       /* Woken when no frame is in flight */
+        /* Statistics */
+        unsigned long rx_frames;         /* Frames received with valid CRC */
+        unsigned long crc_errors;
+        unsigned long spi_errors;
+        unsigned long missed_edges;      /* READY edges with no free buffer */
+        unsigned long pool_empty;        /* Of those, rx_pool ran out */
 } drvdata_t;
 
 
+/* Probe and remove only. Per frame messages are dev_dbg or ratelimited */
 #define DEV_DEBUG       dev_info
 // #define DEBUG_DUMP_SPI // DUMP SPI device on succesful probe
 // #define DEBUG_DUMP_CRC // DUMP data and CRC32 alternatives on each received
@@ -33,12 +126,15 @@ typedef struct _drvdata_t {
 /**
  * Forward declarations
 */
-static int get_block_sync(struct spi_device *spidev, size_t n, u8 *buf);
+static int get_block_sync(drvdata_t *drvdata, size_t n, u8 *buf);
 static irq_handler_t top_ready_handler = NULL; /* Use default top half */
 static irqreturn_t bottom_ready_handler(int irq, void *dev_id);
-static int get_block_sync(struct spi_device *spidev, size_t n, u8 *buf);
+static void get_block_async(drvdata_t *drvdata);
+static void rx_frame_complete(void *context);
+static void rx_work_handler(struct work_struct *work);
 static int module_probe(struct spi_device *spidev);
 static void module_remove(struct spi_device *spidev);
+static void rx_pool_exit(void);
 static int __init spi_module_init(void);
 static void __exit spi_module_exit(void);
 
@@ -66,89 +162,244 @@ static void dump_spi_device(struct spi_device *spidev) {
 /**
  * @brief Dump misc CRC32 computations for debug
 */
-static void dump_crc32(struct device *dev) {
-        drvdata_t *drvdata = (drvdata_t *) dev_get_drvdata(dev);
+static void dump_crc32(struct device *dev, const u8 *rx_data) {
         u32 comp_crc = 0;
-        u32 recv_crc = *( (u32*) &drvdata->rx_data[RX_BUFFER_SIZE - 4]);
+        u32 recv_crc = *( (u32*) &rx_data[RX_BUFFER_SIZE - 4]);
 
-        DEV_DEBUG(dev, "Received CRC: 0x%x\n", recv_crc);
+        dev_dbg(dev, "Received CRC: 0x%x\n", recv_crc);
         comp_crc = ether_crc(RX_BUFFER_SIZE - sizeof(u32),
-                        (unsigned char *) drvdata->rx_data);
-        DEV_DEBUG(dev, "ether_crc:    CRC 0x%x, ICRC 0x%x\n",
+                        (unsigned char *) rx_data);
+        dev_dbg(dev, "ether_crc:    CRC 0x%x, ICRC 0x%x\n",
                         comp_crc, comp_crc ^ 0xffffffff);
 
         comp_crc = ether_crc_le(RX_BUFFER_SIZE - sizeof(u32),
-                        (unsigned char *) drvdata->rx_data);
-        DEV_DEBUG(dev, "ether_crc_le: CRC 0x%x, ICRC 0x%x\n",
+                        (unsigned char *) rx_data);
+        dev_dbg(dev, "ether_crc_le: CRC 0x%x, ICRC 0x%x\n",
                         comp_crc, comp_crc ^ 0xffffffff);
 
-        comp_crc = crc32_le(~0, (unsigned char *) drvdata->rx_data,
+        comp_crc = crc32_le(~0, (unsigned char *) rx_data,
                         RX_BUFFER_SIZE - sizeof(u32));
-        DEV_DEBUG(dev, "crc_le:       CRC 0x%x, ICRC 0x%x\n",
+        dev_dbg(dev, "crc_le:       CRC 0x%x, ICRC 0x%x\n",
                         comp_crc, comp_crc ^ 0xffffffff);
 
-        comp_crc = crc32_be(~0, (unsigned char *) drvdata->rx_data,
+        comp_crc = crc32_be(~0, (unsigned char *) rx_data,
                         RX_BUFFER_SIZE - sizeof(u32));
-        DEV_DEBUG(dev, "crc_be:       CRC 0x%x, ICRC 0x%x\n",
+        dev_dbg(dev, "crc_be:       CRC 0x%x, ICRC 0x%x\n",
                         comp_crc, comp_crc ^ 0xffffffff);
 
-        comp_crc = crc32_le(0, (unsigned char *) drvdata->rx_data,
+        comp_crc = crc32_le(0, (unsigned char *) rx_data,
                         RX_BUFFER_SIZE - sizeof(u32));
-        DEV_DEBUG(dev, "crc_le:       CRC 0x%x, ICRC 0x%x\n",
+        dev_dbg(dev, "crc_le:       CRC 0x%x, ICRC 0x%x\n",
                         comp_crc, comp_crc ^ 0xffffffff);
 
-        comp_crc = crc32_be(0, (unsigned char *) drvdata->rx_data,
+        comp_crc = crc32_be(0, (unsigned char *) rx_data,
                         RX_BUFFER_SIZE - sizeof(u32));
-        DEV_DEBUG(dev, "crc_be:       CRC 0x%x, ICRC 0x%x\n",
+        dev_dbg(dev, "crc_be:       CRC 0x%x, ICRC 0x%x\n",
                         comp_crc, comp_crc ^ 0xffffffff);
 
-        DEV_DEBUG(dev, "[%s]\n", drvdata->rx_data);
+        dev_dbg(dev, "Data: %*ph\n", (int) min_t(size_t, RX_BUFFER_SIZE, 64),
+                        rx_data);
 }
-#define DEBUG_DUMP_CRC32(dev) dump_crc32(dev)
+#define DEBUG_DUMP_CRC32(dev, buf) dump_crc32(dev, buf)
 #else
-#define DEBUG_DUMP_CRC32(dev) 
+#define DEBUG_DUMP_CRC32(dev, buf) 
 #endif
 
+/**
+ * @brief Take a frame buffer from the pool. May run in atomic context
+ *
+ * The first buffer of a device is its reserved one, further ones must
+ * leave the reservations of the other devices free. A device probed while
+ * the others held every buffer gets its own as soon as one comes back.
+ */
+static u8 *rx_pool_get(drvdata_t *drvdata) {
+        u8 *buf = NULL;
+        unsigned long flags;
+
+        spin_lock_irqsave(&rx_pool.lock, flags);
+        if (!drvdata->pool_used && rx_pool.nr_free) {
+                rx_pool.reserved--;
+                buf = rx_pool.bufs[--rx_pool.nr_free];
+        } else if (rx_pool.nr_free > rx_pool.reserved) {
+                buf = rx_pool.bufs[--rx_pool.nr_free];
+        }
+        if (buf)
+                drvdata->pool_used++;
+        spin_unlock_irqrestore(&rx_pool.lock, flags);
+
+        return buf;
+}
+
+static void rx_pool_put(drvdata_t *drvdata, u8 *buf) {
+        unsigned long flags;
+
+        spin_lock_irqsave(&rx_pool.lock, flags);
+        rx_pool.bufs[rx_pool.nr_free++] = buf;
+        if (!--drvdata->pool_used)
+                rx_pool.reserved++;
+        spin_unlock_irqrestore(&rx_pool.lock, flags);
+}
+
+static int rx_pool_init(void) {
+        rx_pool.bufs = kcalloc(rx_pool_frames, sizeof(u8 *), GFP_KERNEL);
+        if (!rx_pool.bufs)
+                return -ENOMEM;
+        while (rx_pool.nr_free < rx_pool_frames) {
+                rx_pool.bufs[rx_pool.nr_free] = vmalloc(RX_BUFFER_SIZE+4);
+                if (!rx_pool.bufs[rx_pool.nr_free]) {
+                        rx_pool_exit();
+                        return -ENOMEM;
+                }
+                rx_pool.nr_free++;
+        }
+        rx_pool.size = rx_pool_frames;
+        return 0;
+}
+
+/**
+ * @brief devm action. Runs after remove(), with all buffers back
+ */
+static void rx_pool_unreserve(void *data) {
+        mutex_lock(&rx_pool_mutex);
+        spin_lock_irq(&rx_pool.lock);
+        rx_pool.nr_devices--;
+        rx_pool.reserved--;
+        spin_unlock_irq(&rx_pool.lock);
+        mutex_unlock(&rx_pool_mutex);
+}
+
+/**
+ * @brief Reserve a buffer for a device being probed. May sleep
+ *
+ * Adds a buffer to the pool first if every one is reserved already. A
+ * pool grown this way stays that size until the module is unloaded.
+ */
+static int rx_pool_reserve(drvdata_t *drvdata) {
+        u8 *buf;
+        u8 **bufs, **old = NULL;
+
+        mutex_lock(&rx_pool_mutex);
+        if (rx_pool.nr_devices == rx_pool.size) {
+                buf = vmalloc(RX_BUFFER_SIZE+4);
+                bufs = kcalloc(rx_pool.size + 1, sizeof(u8 *), GFP_KERNEL);
+                if (!buf || !bufs) {
+                        vfree(buf);
+                        kfree(bufs);
+                        mutex_unlock(&rx_pool_mutex);
+                        return -ENOMEM;
+                }
+                spin_lock_irq(&rx_pool.lock);
+                memcpy(bufs, rx_pool.bufs, rx_pool.nr_free * sizeof(u8 *));
+                bufs[rx_pool.nr_free++] = buf;
+                old = rx_pool.bufs;
+                rx_pool.bufs = bufs;
+                rx_pool.size++;
+                spin_unlock_irq(&rx_pool.lock);
+                kfree(old);
+        }
+        spin_lock_irq(&rx_pool.lock);
+        rx_pool.nr_devices++;
+        rx_pool.reserved++;
+        spin_unlock_irq(&rx_pool.lock);
+        mutex_unlock(&rx_pool_mutex);
+
+        return devm_add_action_or_reset(&drvdata->spidev->dev,
+                                        rx_pool_unreserve, NULL);
+}
+
+/**
+ * @brief Free the pool. All buffers must be back, i.e. no device bound
+ */
+static void rx_pool_exit(void) {
+        while (rx_pool.nr_free)
+                vfree(rx_pool.bufs[--rx_pool.nr_free]);
+        kfree(rx_pool.bufs);
+        rx_pool.bufs = NULL;
+}
+
+/**
+ * @brief Check CRC of a received frame and account for it
+ */
+static void process_frame(drvdata_t *drvdata, rx_frame_t *frame) {
+        size_t i;
+        u32 recv_crc;
+        u32 comp_crc;
+        struct spi_device *spidev = drvdata->spidev;
+
+        if (frame->status) {
+                drvdata->spi_errors++;
+                dev_err_ratelimited(&spidev->dev, "SPI transfer failed %d\n",
+                                    frame->status);
+                return;
+        }
+
+        /*
+         * Wider words land in CPU byte order. The CRC is over the bytes in
+         * wire order, MSB of each word first.
+         */
+        if (drvdata->bits_per_word == 16)
+                for (i = 0; i < RX_BUFFER_SIZE / sizeof(u16); i++)
+                        cpu_to_be16s((u16 *) frame->rx_data + i);
+        else if (drvdata->bits_per_word == 32)
+                for (i = 0; i < RX_BUFFER_SIZE / sizeof(u32); i++)
+                        cpu_to_be32s((u32 *) frame->rx_data + i);
+
+        DEBUG_DUMP_CRC32(&spidev->dev, frame->rx_data);
+        comp_crc = crc32_be(~0, (unsigned char *) frame->rx_data,
+                RX_BUFFER_SIZE - sizeof(u32));
+        recv_crc = *((u32 *) (&frame->rx_data[RX_BUFFER_SIZE - sizeof(u32)]));
+        if (comp_crc != recv_crc) {
+                drvdata->crc_errors++;
+                dev_err_ratelimited(&spidev->dev,
+                        "Error on SPI. Got CRC 0x%x, expected 0x%x\n",
+                        recv_crc, comp_crc);
+                return;
+        }
+        drvdata->rx_frames++;
+}
+
 /**
  * @brief Handle interrupt in bottom half (in another thread)
+ *
+ * In async mode the transfer is only started here, so the thread returns
+ * (and the READY IRQ is unmasked) while the frame is still on the wire.
  */
 static irqreturn_t bottom_ready_handler(int irq, void *dev_id) {
         int ready_pin;
-        int retval;
-        u32 recv_crc;
-        u32 comp_crc;
         ktime_t spi_ticks;
         struct spi_device *spidev = (struct spi_device *) dev_id;
         drvdata_t *drvdata = spi_get_drvdata(spidev);
+        rx_frame_t *frame = &drvdata->frames[0];
+
+        if (rx_async) {
+                get_block_async(drvdata);
+                return IRQ_HANDLED;
+        }
 
         /* Get state of READY GPIO pin */
         ready_pin = gpiod_get_value(drvdata->ready);
 
-        DEV_DEBUG(&spidev->dev, "start spi");
+        frame->rx_data = rx_pool_get(drvdata);
+        if (!frame->rx_data) {
+                drvdata->missed_edges++;
+                drvdata->pool_empty++;
+                return IRQ_HANDLED;
+        }
+
+        dev_dbg(&spidev->dev, "start spi\n");
 
         gpiod_set_value(drvdata->busy, 1);
         spi_ticks = ktime_get();
-        retval = get_block_sync(spidev, RX_BUFFER_SIZE, drvdata->rx_data);
+        frame->status = get_block_sync(drvdata, RX_BUFFER_SIZE,
+                                       frame->rx_data);
         spi_ticks = ktime_get() - spi_ticks;
         gpiod_set_value(drvdata->busy, 0);
-        if (retval) {
-                dev_err(&spidev->dev, "get_block_sync failed %d\n", retval);
-                return IRQ_HANDLED;
-        }
-        DEV_DEBUG(&spidev->dev, "ended spi (ktime delta = %lld nsecs)",
+        dev_dbg(&spidev->dev, "ended spi (ktime delta = %lld nsecs)\n",
                 spi_ticks);
 
-        DEBUG_DUMP_CRC32(&spidev->dev);
-        comp_crc = crc32_be(~0, (unsigned char *) drvdata->rx_data,
-                RX_BUFFER_SIZE - sizeof(u32));
-        recv_crc = *((u32 *) (&drvdata->rx_data[RX_BUFFER_SIZE - sizeof(u32)]));
-        if (comp_crc != recv_crc) {
-                dev_err(&spidev->dev,
-                        "Error on SPI. Got CRC 0x%x, expected 0x%x\n",
-                        recv_crc, comp_crc);
-                return IRQ_HANDLED;
-        }
-        DEV_DEBUG(&spidev->dev, "READY state is %d, irq=%d\n", ready_pin, irq);
+        process_frame(drvdata, frame);
+        rx_pool_put(drvdata, frame->rx_data);
+        dev_dbg(&spidev->dev, "READY state is %d, irq=%d\n", ready_pin, irq);
    
         return IRQ_HANDLED;
 }
@@ -156,11 +407,14 @@ static irqreturn_t bottom_ready_handler(int irq, void *dev_id) {
 /**
  * @brief Get block of data in synchronous mode
 */
-static int get_block_sync(struct spi_device *spidev, size_t n, u8 *buf) {
+static int get_block_sync(drvdata_t *drvdata, size_t n, u8 *buf) {
         int retval;
         struct spi_message msg;
+        struct spi_device *spidev = drvdata->spidev;
         struct spi_transfer t = {
                 .speed_hz = spidev->max_speed_hz,
+                .bits_per_word = drvdata->bits_per_word,
+                .rx_nbits = drvdata->rx_nbits,
                 .rx_buf = buf,
                 .len = n
         };
@@ -173,10 +427,154 @@ static int get_block_sync(struct spi_device *spidev, size_t n, u8 *buf) {
         return retval;
 }
 
+/**
+ * @brief Start reception of a frame into the next free buffer
+ *
+ * Counts a missed edge when all rx_frames are still in flight or waiting
+ * for rx_work, or the pool has no buffer left.
+ */
+static void get_block_async(drvdata_t *drvdata) {
+        int retval;
+        unsigned long flags;
+        rx_frame_t *frame;
+        struct spi_device *spidev = drvdata->spidev;
+
+        spin_lock_irqsave(&drvdata->rx_lock, flags);
+        if (drvdata->rx_submit - smp_load_acquire(&drvdata->rx_tail)
+                        >= rx_frames) {
+                drvdata->missed_edges++;
+                spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+                return;
+        }
+        frame = &drvdata->frames[drvdata->rx_submit & (rx_frames - 1)];
+        frame->rx_data = rx_pool_get(drvdata);
+        if (!frame->rx_data) {
+                drvdata->missed_edges++;
+                drvdata->pool_empty++;
+                spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+                return;
+        }
+        if (drvdata->rx_submit == drvdata->rx_done)
+                gpiod_set_value(drvdata->busy, 1);
+        drvdata->rx_submit++;
+        spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+
+        frame->xfer = (struct spi_transfer) {
+                .speed_hz = spidev->max_speed_hz,
+                .bits_per_word = drvdata->bits_per_word,
+                .rx_nbits = drvdata->rx_nbits,
+                .rx_buf = frame->rx_data,
+                .len = RX_BUFFER_SIZE
+        };
+        spi_message_init_with_transfers(&frame->msg, &frame->xfer, 1);
+        frame->msg.complete = rx_frame_complete;
+        frame->msg.context = frame;
+
+        retval = spi_async(spidev, &frame->msg);
+        if (retval) {
+                /* Not queued, so complete it here to keep the counters in step */
+                frame->msg.status = retval;
+                rx_frame_complete(frame);
+        }
+}
+
+/**
+ * @brief SPI completion callback. May run in atomic context
+ */
+static void rx_frame_complete(void *context) {
+        unsigned long flags;
+        rx_frame_t *frame = (rx_frame_t *) context;
+        drvdata_t *drvdata = frame->drvdata;
+
+        frame->status = frame->msg.status;
+
+        spin_lock_irqsave(&drvdata->rx_lock, flags);
+        drvdata->rx_done++;
+        if (drvdata->rx_done == drvdata->rx_submit) {
+                gpiod_set_value(drvdata->busy, 0);
+                wake_up(&drvdata->rx_idle);
+        }
+        spin_unlock_irqrestore(&drvdata->rx_lock, flags);
+
+        queue_work(system_highpri_wq, &drvdata->rx_work);
+}
+
+/**
+ * @brief Check completed frames and hand their buffers back
+ */
+static void rx_work_handler(struct work_struct *work) {
+        unsigned int done;
+        rx_frame_t *frame;
+        drvdata_t *drvdata = container_of(work, drvdata_t, rx_work);
+
+        spin_lock_irq(&drvdata->rx_lock);
+        done = drvdata->rx_done;
+        spin_unlock_irq(&drvdata->rx_lock);
+
+        while (drvdata->rx_tail != done) {
+                frame = &drvdata->frames[drvdata->rx_tail & (rx_frames - 1)];
+                process_frame(drvdata, frame);
+                rx_pool_put(drvdata, frame->rx_data);
+                frame->rx_data = NULL;
+                smp_store_release(&drvdata->rx_tail, drvdata->rx_tail + 1);
+        }
+}
+
+static bool rx_quiesced(drvdata_t *drvdata) {
+        bool idle;
+
+        spin_lock_irq(&drvdata->rx_lock);
+        idle = drvdata->rx_done == drvdata->rx_submit;
+        spin_unlock_irq(&drvdata->rx_lock);
+
+        return idle;
+}
+
+/*
+ * Statistics in sysfs. Used for comparing async and sync receive.
+ */
+#define DRVDATA_ATTR_RO(name)                                                 \
+static ssize_t name##_show(struct device *dev,                                \
+                           struct device_attribute *attr, char *buf) {        \
+        drvdata_t *drvdata = dev_get_drvdata(dev);                       \
+        return sysfs_emit(buf, "%lu\n", READ_ONCE(drvdata->name));            \
+}                                                                             \
+static DEVICE_ATTR_RO(name)
+
+DRVDATA_ATTR_RO(rx_frames);
+DRVDATA_ATTR_RO(crc_errors);
+DRVDATA_ATTR_RO(spi_errors);
+DRVDATA_ATTR_RO(missed_edges);
+DRVDATA_ATTR_RO(pool_empty);
+
+/* Free buffers in the pool, the same for all devices */
+static ssize_t pool_free_show(struct device *dev,
+                              struct device_attribute *attr, char *buf) {
+        return sysfs_emit(buf, "%u of %u\n", READ_ONCE(rx_pool.nr_free),
+                          READ_ONCE(rx_pool.size));
+}
+static DEVICE_ATTR_RO(pool_free);
+
+static struct attribute *spi_protocol_attrs[] = {
+        &dev_attr_rx_frames.attr,
+        &dev_attr_crc_errors.attr,
+        &dev_attr_spi_errors.attr,
+        &dev_attr_missed_edges.attr,
+        &dev_attr_pool_empty.attr,
+        &dev_attr_pool_free.attr,
+        NULL
+};
+ATTRIBUTE_GROUPS(spi_protocol);
+
+static void rx_frames_free(void *frames) {
+        kvfree(frames);
+}
+
 /**
  * @brief Probe SPI and GPIO
 */
 static int module_probe(struct spi_device *spidev) {
+        int i;
         int retval;
         drvdata_t *drvdata;
 
@@ -184,8 +582,27 @@ static int module_probe(struct spi_device *spidev) {
 
         drvdata = (drvdata_t *) devm_kzalloc(&spidev->dev,
                                         sizeof(drvdata_t), GFP_KERNEL);
-        drvdata->rx_data = (u8 *) devm_kzalloc(&spidev->dev,
-                                        RX_BUFFER_SIZE+4, GFP_KERNEL);
+        if (!drvdata)
+                return -ENOMEM;
+        drvdata->spidev = spidev;
+        spin_lock_init(&drvdata->rx_lock);
+        INIT_WORK(&drvdata->rx_work, rx_work_handler);
+        init_waitqueue_head(&drvdata->rx_idle);
+
+        /* Buffers come from rx_pool per frame, only the messages are here */
+        drvdata->frames = kvcalloc(rx_frames, sizeof(rx_frame_t), GFP_KERNEL);
+        if (!drvdata->frames)
+                return -ENOMEM;
+        retval = devm_add_action_or_reset(&spidev->dev, rx_frames_free,
+                                          drvdata->frames);
+        if (retval)
+                return retval;
+        for (i = 0; i < rx_frames; i++)
+                drvdata->frames[i].drvdata = drvdata;
+
+        retval = rx_pool_reserve(drvdata);
+        if (retval)
+                return retval;
 
         retval = spi_setup(spidev);
         if (retval < 0) {
@@ -193,6 +610,31 @@ static int module_probe(struct spi_device *spidev) {
                 return retval;
         }
         DEV_DEBUG(&spidev->dev, "spi_setup success\n");
+
+        /* spi_setup() dropped spi-rx-bus-width if the controller lacks it */
+        drvdata->rx_nbits = spidev->mode & SPI_RX_QUAD ? SPI_NBITS_QUAD :
+                            spidev->mode & SPI_RX_DUAL ? SPI_NBITS_DUAL :
+                                                         SPI_NBITS_SINGLE;
+        /* The module parameter, when given, wins over DT */
+        drvdata->bits_per_word = 8;
+        of_property_read_u32(spidev->dev.of_node, "spi-bits-per-word",
+                             &drvdata->bits_per_word);
+        if (rx_bits_per_word)
+                drvdata->bits_per_word = rx_bits_per_word;
+        if (drvdata->bits_per_word != 8 && drvdata->bits_per_word != 16 &&
+            drvdata->bits_per_word != 32) {
+                dev_err(&spidev->dev, "%u bits per word not usable. Must be "
+                        "8, 16 or 32\n", drvdata->bits_per_word);
+                return -EINVAL;
+        }
+        if (!spi_is_bpw_supported(spidev, drvdata->bits_per_word)) {
+                dev_warn(&spidev->dev, "Controller has no %u bit words, "
+                         "using 8\n", drvdata->bits_per_word);
+                drvdata->bits_per_word = 8;
+        }
+        DEV_DEBUG(&spidev->dev, "Frames in %u bit words on %u data lines\n",
+                  drvdata->bits_per_word, drvdata->rx_nbits);
+
         drvdata->busy = devm_gpiod_get(&spidev->dev,
                                 "mycomp,busy", GPIOD_OUT_LOW | GPIOD_FLAGS_BIT_NONEXCLUSIVE);
         if (IS_ERR(drvdata->busy)) {
@@ -203,7 +645,7 @@ static int module_probe(struct spi_device *spidev) {
         drvdata->ready = devm_gpiod_get(&spidev->dev, "mycomp,ready", GPIOD_IN);
         if (IS_ERR(drvdata->ready)) {
                 dev_err(&spidev->dev, "gpiod_get failed for READY\n");
-                return PTR_ERR(drvdata->busy);
+                return PTR_ERR(drvdata->ready);
         }
 
         drvdata->irq = gpiod_to_irq(drvdata->ready);
@@ -213,14 +655,19 @@ static int module_probe(struct spi_device *spidev) {
         }
         DEV_DEBUG(&spidev->dev, "GPIOD irq = %d.\n", drvdata->irq);
 
+        /* The handler may run as soon as the IRQ is requested */
+        spi_set_drvdata(spidev, drvdata);
+
         retval = request_threaded_irq(drvdata->irq,
                                  top_ready_handler,
                                  bottom_ready_handler,
                                  IRQF_TRIGGER_RISING  | IRQF_ONESHOT,
                                  "spi-protocol-sample",
                                  spidev);
-
-        spi_set_drvdata(spidev, drvdata);
+        if (retval) {
+                dev_err(&spidev->dev, "request_threaded_irq failed %d\n", retval);
+                return retval;
+        }
 
         DEBUG_DUMP_SPI_DEVICE(spidev);
 
@@ -236,8 +683,9 @@ static void module_remove(struct spi_device *spidev) {
                 return;
         }
         free_irq(drvdata->irq, spidev);
-        gpiod_put(drvdata->ready);
-        gpiod_put(drvdata->busy);
+        /* No new frames after free_irq(). Let the queued ones finish */
+        wait_event(drvdata->rx_idle, rx_quiesced(drvdata));
+        flush_work(&drvdata->rx_work);
         DEV_DEBUG(&spidev->dev, "module remove\n");
 };
 
@@ -255,20 +703,39 @@ static struct spi_driver spi_driver = {
                 .name = "spi-protocol-device",
                 .of_match_table = of_match_ptr(spi_dt_ids),
                 .owner = THIS_MODULE,
+                .dev_groups = spi_protocol_groups,
         },
 };
 
 static int __init spi_module_init(void)
 {
+        int retval;
+
         pr_info("%s: module init\n", SPI_MODULE);
+        if (rx_frames < 2 || rx_frames > RX_MAX_FRAMES ||
+            !is_power_of_2(rx_frames) || !rx_pool_frames) {
+                pr_err("%s: rx_frames must be a power of 2, 2 to %d, and "
+                       "rx_pool_frames at least 1\n", SPI_MODULE, RX_MAX_FRAMES);
+                return -EINVAL;
+        }
+        /* Before any probe, so probing only allocates past one per device */
+        retval = rx_pool_init();
+        if (retval) {
+                pr_err("%s: no memory for %u frame buffers\n", SPI_MODULE,
+                       rx_pool_frames);
+                return retval;
+        }
         /* Register spi driver */
-        spi_register_driver(&spi_driver);
-        return 0;
+        retval = spi_register_driver(&spi_driver);
+        if (retval)
+                rx_pool_exit();
+        return retval;
 }
 
 static void __exit spi_module_exit(void)
 {
         spi_unregister_driver(&spi_driver);
+        rx_pool_exit();
         pr_info("%s: module exit\n", SPI_MODULE);
 }
 
@@ -0,0 +1,213 @@
+#!/bin/bash
+#
+# Benchmark cdev-spi-sample or spi-protocol-sample against the simulated
+# SPI controller, no hardware needed. Run as root from a built tree
+# (make bench at the top level builds and runs it).
+#
+#   bench.sh [-D cdev|protocol] [-d devices] [-r frames/s] [-t seconds]
+#            [-s frame_size] [-c corrupt_every] [-w]
+#            [-C read|splice|socket]
+#            [driver params...]
+#
+# Needs gpio-sim (CONFIG_GPIO_SIM), configfs and debugfs.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+TOP=$(dirname "$HERE")
+CONFIGFS=/sys/kernel/config/gpio-sim
+SIM=spi-sim-bench
+
+driver=cdev
+devices=2
+rate=1000
+secs=10
+frame_size=40956
+corrupt_every=0
+wire_time=0
+
+capture=
+capdir=
+
+usage() {
+        sed -n '3,12p' "$0" | sed 's/^# \{0,1\}//'
+        exit 2
+}
+
+while getopts "D:d:r:t:s:c:wC:h" opt; do
+        case $opt in
+        D) driver=$OPTARG ;;
+        d) devices=$OPTARG ;;
+        r) rate=$OPTARG ;;
+        t) secs=$OPTARG ;;
+        s) frame_size=$OPTARG ;;
+        c) corrupt_every=$OPTARG ;;
+        w) wire_time=1 ;;
+        C) capture=$OPTARG ;;
+        *) usage ;;
+        esac
+done
+case $capture in
+""|read|splice|socket) ;;
+*) usage ;;
+esac
+shift $((OPTIND - 1))
+params="$*"
+
+case $driver in
+cdev)
+        module=$TOP/cdev-spi-sample/cdev-spi-sample.ko
+        modname=cdev_spi_sample
+        modalias=cdev-spi-sample
+        params="rx_frame_size=$frame_size $params"
+        ;;
+protocol)
+        module=$TOP/spi-protocol-sample/spi-protocol-sample.ko
+        modname=spi_protocol_sample
+        modalias=spi-protocol-device
+        frame_size=40956         # RX_BUFFER_SIZE less the CRC, fixed
+        ;;
+*)
+        usage
+        ;;
+esac
+
+header=0
+case " $params " in
+*" rx_header=1 "*|*" rx_header=y "*) header=1 ;;
+esac
+
+[ "$(id -u)" = 0 ] || { echo "run as root" >&2; exit 1; }
+modprobe gpio-sim
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+cleanup() {
+        set +e
+        [ -n "$readers" ] && kill $readers 2>/dev/null && wait $readers 2>/dev/null
+        rmmod spi_sim 2>/dev/null
+        rmmod $modname 2>/dev/null
+        [ -n "$capdir" ] && rm -rf "$capdir"
+        if [ -d $CONFIGFS/$SIM ]; then
+                echo 0 > $CONFIGFS/$SIM/live
+                rmdir $CONFIGFS/$SIM/gpio-bank0 $CONFIGFS/$SIM
+        fi
+}
+trap cleanup EXIT
+
+# Line 0 is BUSY, line 1 + cs is READY of chip select cs
+mkdir $CONFIGFS/$SIM $CONFIGFS/$SIM/gpio-bank0
+echo spi-sim > $CONFIGFS/$SIM/gpio-bank0/label
+echo $((devices + 1)) > $CONFIGFS/$SIM/gpio-bank0/num_lines
+echo 1 > $CONFIGFS/$SIM/live
+chipdir=/sys/devices/platform/$(cat $CONFIGFS/$SIM/dev_name)/$(cat $CONFIGFS/$SIM/gpio-bank0/chip_name)
+
+insmod "$module" $params
+insmod "$HERE/spi-sim.ko" devices=$devices modalias=$modalias \
+        frame_size=$frame_size header=$header corrupt_every=$corrupt_every \
+        wire_time=$wire_time
+
+spidevs=$(for d in /sys/bus/spi/devices/*; do
+        case $(readlink -f "$d") in
+        */platform/spi-sim/*) echo "$d" ;;
+        esac
+done)
+[ -n "$spidevs" ] || { echo "no devices on spi-sim" >&2; exit 1; }
+
+# cdev-spi-sample queues frames for a reader, keep them flowing. With -C
+# the readers capture to files on disk, by read()/write() or splice(), or
+# splice into a local socket whose other end checks the records
+readers=
+if [ $driver = cdev ]; then
+        [ -n "$capture" ] && capdir=$(mktemp -d /var/tmp/spi-sim-bench.XXXXXX)
+        for ((minor = 0; minor < devices; minor++)); do
+                args="-t $secs"
+                log=/dev/null
+                if [ -n "$capture" ]; then
+                        case $capture in
+                        splice) args="$args -s -o $capdir/cdev_spi$minor.rec" ;;
+                        socket) args="$args -S" ;;
+                        *) args="$args -o $capdir/cdev_spi$minor.rec" ;;
+                        esac
+                        log=$capdir/reader$minor.log
+                fi
+                "$TOP/cdev-spi-sample/cdev-spi-reader" $args \
+                        /dev/cdev_spi$minor > $log &
+                readers="$readers $!"
+        done
+fi
+
+cpu0=($(head -1 /proc/stat))
+t0=$(date +%s.%N)
+"$HERE/spi-sim-gen" -d $devices -r $rate -t $secs "$chipdir"
+sleep 0.2                        # Let the last frames land
+t1=$(date +%s.%N)
+cpu1=($(head -1 /proc/stat))
+
+sum() {
+        local total=0 d
+        for d in $spidevs; do
+                [ -f $d/$1 ] && total=$((total + $(cat $d/$1)))
+        done
+        echo $total
+}
+
+frames=$(sum rx_frames)
+if [ $driver = cdev ]; then
+        bytes=$(sum rx_bytes)
+else
+        bytes=$((frames * frame_size))
+fi
+
+echo
+echo "$driver: $devices devices, $rate frames/s each, $frame_size byte frames, $params"
+awk -v f=$frames -v b=$bytes -v t0=$t0 -v t1=$t1 'BEGIN {
+        t = t1 - t0
+        printf "  %d frames, %.1f frames/s, %.2f MB/s\n", f, f / t, b / t / 1e6
+}'
+echo "  crc_errors $(sum crc_errors) spi_errors $(sum spi_errors)" \
+     "missed_edges $(sum missed_edges) rx_recovered $(sum rx_recovered)"
+
+# user nice system idle iowait irq softirq steal
+awk -v a="${cpu0[*]}" -v b="${cpu1[*]}" -v n=$(nproc) 'BEGIN {
+        split(a, x); split(b, y)
+        for (i = 2; i <= 9; i++) total += y[i] - x[i]
+        idle = y[5] - x[5] + y[6] - x[6]
+        printf "  cpu %.1f%% of %d cpus (irq+softirq %.1f%%)\n",
+               100 * (total - idle) / total, n,
+               100 * (y[7] - x[7] + y[8] - x[8]) / total
+}'
+
+# Percentiles are the upper bound of the log2 bucket they fall in
+awk '/^    </ { ns[$2] += $4; total += $4 }
+END {
+        if (!total) { print "  edge_to_start: no samples"; exit }
+        split("50 90 99 99.9", p, " ")
+        line = "  edge_to_start:"
+        for (i = 1; i <= 4; i++) {
+                sum = 0
+                for (b = 1; b < 2 ^ 32; b *= 2) {
+                        sum += ns[b]
+                        if (sum * 100 >= total * p[i])
+                                break
+                }
+                line = line sprintf(" p%s < %d us", p[i], (b + 999) / 1000)
+        }
+        print line
+}' /sys/kernel/debug/spi_sim/stats
+
+if [ -n "$capdir" ]; then
+        wait $readers || true
+        readers=
+        for ((minor = 0; minor < devices; minor++)); do
+                echo "  capture cdev_spi$minor ($capture):"
+                sed 's/^/    /' $capdir/reader$minor.log
+        done
+fi
+
+if [ $driver = cdev ]; then
+        for f in /sys/kernel/debug/cdev_spi/*/latency; do
+                echo "  $(basename $(dirname $f)):"
+                grep -E '^[a-z_]+:|p50' $f | paste - - | sed 's/^/    /'
+        done
+fi
@@ -0,0 +1,126 @@
+/*
+ * READY edge generator for the spi-sim bench.
+ *
+ * Pulses the READY line of each simulated device through the gpio-sim
+ * pull attribute at a fixed rate. Before each edge the CLOCK_MONOTONIC
+ * time is handed to spi-sim, which puts the delay until the driver
+ * starts reading that frame into its edge_to_start histogram.
+ *
+ *   spi-sim-gen [-d devices] [-r frames/s] [-n frames] [-t seconds] chipdir
+ *
+ * chipdir is the gpio-sim chip in sysfs, for example
+ * /sys/devices/platform/gpio-sim.0/gpiochip3. Line 1 + <cs> is READY of
+ * chip select <cs>.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SPI_SIM_EDGE     "/sys/kernel/debug/spi_sim/edge"
+#define MAX_DEVICES      8
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_str(int fd, const char *s) {
+        if (pwrite(fd, s, strlen(s), 0) < 0)
+                return -errno;
+        return 0;
+}
+
+int main(int argc, char **argv) {
+        int c;
+        int cs;
+        int retval = 0;
+        int devices = 2;
+        int edge_fd;
+        int pull_fd[MAX_DEVICES];
+        char path[512];
+        char stamp[64];
+        double rate = 1000;
+        double secs = 10;
+        unsigned long n = ~0UL;
+        unsigned long edges = 0;
+        uint64_t period, next, end;
+        struct timespec ts;
+
+        while ((c = getopt(argc, argv, "d:r:n:t:")) != -1) {
+                switch (c) {
+                case 'd':
+                        devices = atoi(optarg);
+                        break;
+                case 'r':
+                        rate = atof(optarg);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 't':
+                        secs = atof(optarg);
+                        break;
+                default:
+                        goto usage;
+                }
+        }
+        if (optind >= argc || devices < 1 || devices > MAX_DEVICES ||
+            rate <= 0)
+                goto usage;
+
+        for (cs = 0; cs < devices; cs++) {
+                snprintf(path, sizeof(path), "%s/sim_gpio%d/pull",
+                         argv[optind], 1 + cs);
+                pull_fd[cs] = open(path, O_WRONLY);
+                if (pull_fd[cs] < 0) {
+                        perror(path);
+                        return 1;
+                }
+        }
+        /* Latency stamps are optional, edges work without debugfs */
+        edge_fd = open(SPI_SIM_EDGE, O_WRONLY);
+
+        period = 1e9 / rate;
+        next = now_ns();
+        end = next + secs * 1e9;
+        while (edges < n && next < end) {
+                for (cs = 0; cs < devices; cs++) {
+                        if (edge_fd >= 0) {
+                                snprintf(stamp, sizeof(stamp), "%d %llu", cs,
+                                         (unsigned long long) now_ns());
+                                write_str(edge_fd, stamp);
+                        }
+                        retval = write_str(pull_fd[cs], "pull-up");
+                        if (!retval)
+                                retval = write_str(pull_fd[cs], "pull-down");
+                        if (retval)
+                                goto out;
+                }
+                edges++;
+
+                next += period;
+                ts.tv_sec = next / 1000000000ULL;
+                ts.tv_nsec = next % 1000000000ULL;
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                       NULL) == EINTR)
+                        ;
+        }
+
+out:
+        if (retval)
+                fprintf(stderr, "READY: %s\n", strerror(-retval));
+        printf("%lu edges per device\n", edges);
+        return retval ? 1 : 0;
+
+usage:
+        fprintf(stderr, "usage: %s [-d devices] [-r frames/s] [-n frames] "
+                "[-t seconds] chipdir\n", argv[0]);
+        return 2;
+}
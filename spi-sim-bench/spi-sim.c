@@ -0,0 +1,518 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/platform_device.h>
+#include <linux/gpio/machine.h>
+#include <linux/spi/spi.h>
+#include <linux/err.h>
+#include <linux/crc32.h>
+#include <linux/timekeeping.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+#include "cdev-spi-sample.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Simulated SPI controller and frame source for benchmarks");
+
+#define SPI_SIM_MODULE           "spi-sim"
+#define SPI_SIM_MAX_DEVICES      8
+#define SPI_SIM_MAX_FRAME_SIZE   (1024*1024)
+#define SPI_SIM_CRC_SIZE         sizeof(u32)
+#define SPI_SIM_HIST_BUCKETS     32
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+#define spi_get_chipselect(spi, idx) ((spi)->chip_select)
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define spi_alloc_host spi_alloc_master
+#endif
+
+static unsigned int devices = 2;
+module_param(devices, uint, 0444);
+MODULE_PARM_DESC(devices, "SPI devices on the simulated bus, one per chip "
+                 "select (default 2)");
+
+static char *modalias = "cdev-spi-sample";
+module_param(modalias, charp, 0444);
+MODULE_PARM_DESC(modalias, "Driver bound to the devices: cdev-spi-sample "
+                 "(default) or spi-protocol-device");
+
+static char *gpio_chip = "spi-sim";
+module_param(gpio_chip, charp, 0444);
+MODULE_PARM_DESC(gpio_chip, "Label of the gpio-sim bank. Line 0 is BUSY, "
+                 "line 1 + <cs> is READY of chip select <cs>");
+
+static unsigned int frame_size = 10*1024*sizeof(u32) - SPI_SIM_CRC_SIZE;
+module_param(frame_size, uint, 0444);
+MODULE_PARM_DESC(frame_size, "Payload bytes per frame, without the CRC "
+                 "(default 40956). Must match the driver");
+
+static bool header;
+module_param(header, bool, 0444);
+MODULE_PARM_DESC(header, "Send a struct cdev_spi_frame_hdr ahead of each "
+                 "frame, for cdev-spi-sample rx_header=1 (default false)");
+
+static unsigned int max_speed_hz = 20000000;
+module_param(max_speed_hz, uint, 0444);
+MODULE_PARM_DESC(max_speed_hz, "SPI clock given to the devices "
+                 "(default 20 MHz)");
+
+static unsigned int rx_bus_width = 1;
+module_param(rx_bus_width, uint, 0444);
+MODULE_PARM_DESC(rx_bus_width, "MISO lines of the devices, 1 (default), 2 or "
+                 "4, like spi-rx-bus-width in DT");
+
+static bool wire_time;
+module_param(wire_time, bool, 0644);
+MODULE_PARM_DESC(wire_time, "Take as long as the transfer would on the wire "
+                 "at its clock (default false, transfers finish at once)");
+
+static unsigned int corrupt_every;
+module_param(corrupt_every, uint, 0644);
+MODULE_PARM_DESC(corrupt_every, "Corrupt every n:th frame, so it fails CRC "
+                 "(default 0, never)");
+
+static unsigned int corrupt_next;
+module_param(corrupt_next, uint, 0644);
+MODULE_PARM_DESC(corrupt_next, "Corrupt the next n frames. Counts down");
+
+/**
+ * @brief Log2 histogram in ns, same buckets as cdev-spi-sample
+ */
+struct spi_sim_hist {
+        unsigned long bucket[SPI_SIM_HIST_BUCKETS];
+};
+
+/**
+ * @brief The simulated device behind one chip select
+ *
+ * The device streams frames: header (with header=1), payload and CRC,
+ * back to back. Each transfer clocks out the next bytes of the current
+ * frame, whatever the driver splits it into. Releasing chip select ends
+ * the frame like NSS does on the STM32, so a driver that reads too little
+ * gets back in step at the next one. A frame starting with
+ * CDEV_SPI_CMD_RETRANSMIT on MOSI sends the last frame again, intact.
+ */
+struct spi_sim_dev {
+        u8 *frame;                       /* Header, payload and CRC */
+        size_t frame_len;
+        size_t pos;                      /* Next byte of frame to send */
+        u16 seq;
+        bool corrupt;                    /* Current frame goes out damaged */
+        bool started;
+        atomic64_t edge_ns;              /* Last READY edge, from spi-sim-gen */
+        /* Statistics */
+        unsigned long frames;
+        unsigned long corrupted;
+        unsigned long retransmits;
+        unsigned long resyncs;           /* CS released inside a frame */
+        struct spi_sim_hist hist_edge;   /* READY edge to frame start */
+};
+
+struct spi_sim {
+        struct platform_device *pdev;
+        struct spi_controller *ctlr;
+        struct gpiod_lookup_table *lookup[SPI_SIM_MAX_DEVICES];
+        struct spi_sim_dev dev[SPI_SIM_MAX_DEVICES];
+        struct dentry *debugfs;
+};
+
+static struct spi_sim *spi_sim;
+
+/**
+ * Forward declarations
+*/
+static int spi_sim_transfer_one(struct spi_controller *ctlr,
+                                struct spi_device *spi,
+                                struct spi_transfer *xfer);
+static void spi_sim_set_cs(struct spi_device *spi, bool level);
+static int __init spi_module_init(void);
+static void __exit spi_module_exit(void);
+
+/**
+ * @brief Between wire byte order and SPI words in CPU byte order
+ *
+ * Wider words are clocked MSB first and stored as CPU words, like a real
+ * controller does.
+ */
+static void spi_sim_swab_words(void *buf, size_t len,
+                               unsigned int bits_per_word) {
+        size_t i;
+
+        if (bits_per_word == 16)
+                for (i = 0; i < len / sizeof(u16); i++)
+                        cpu_to_be16s((u16 *) buf + i);
+        else if (bits_per_word == 32)
+                for (i = 0; i < len / sizeof(u32); i++)
+                        cpu_to_be32s((u32 *) buf + i);
+}
+
+static void spi_sim_hist_add(struct spi_sim_hist *hist, u64 ns) {
+        unsigned int n = min_t(unsigned int, fls64(ns), SPI_SIM_HIST_BUCKETS - 1);
+
+        hist->bucket[n]++;
+}
+
+/**
+ * @brief Build the frame template of a device once
+ *
+ * The payload is a fixed pattern, so its CRC is computed here and every
+ * frame costs the simulator only the copy. crc32_be with init ~0, stored
+ * in CPU order, as both drivers check by default.
+ */
+static int spi_sim_dev_init(struct spi_sim_dev *sim) {
+        size_t i;
+        size_t hdr_len = header ? sizeof(struct cdev_spi_frame_hdr) : 0;
+        u8 *payload;
+
+        sim->frame_len = hdr_len + frame_size + SPI_SIM_CRC_SIZE;
+        sim->frame = vmalloc(sim->frame_len);
+        if (!sim->frame)
+                return -ENOMEM;
+        atomic64_set(&sim->edge_ns, 0);
+
+        payload = sim->frame + hdr_len;
+        for (i = 0; i < frame_size; i++)
+                payload[i] = i * 7 + (i >> 8);
+        put_unaligned(crc32_be(~0, payload, frame_size),
+                      (u32 *) (payload + frame_size));
+        return 0;
+}
+
+/**
+ * @brief Move on to the next frame, or repeat the last one
+ */
+static void spi_sim_frame_start(struct spi_sim_dev *sim,
+                                const struct spi_transfer *xfer) {
+        u64 edge_ns;
+        struct cdev_spi_cmd cmd = {};
+        struct cdev_spi_frame_hdr *hdr = (void *) sim->frame;
+
+        if (xfer->tx_buf && xfer->len >= sizeof(cmd)) {
+                memcpy(&cmd, xfer->tx_buf, sizeof(cmd));
+                spi_sim_swab_words(&cmd, sizeof(cmd), xfer->bits_per_word);
+        }
+        if (sim->started && cmd.type == CDEV_SPI_CMD_RETRANSMIT) {
+                sim->corrupt = false;
+                sim->retransmits++;
+                return;
+        }
+
+        sim->started = true;
+        sim->seq++;
+        sim->frames++;
+        if (READ_ONCE(corrupt_next)) {
+                WRITE_ONCE(corrupt_next, corrupt_next - 1);
+                sim->corrupt = true;
+        } else {
+                sim->corrupt = corrupt_every &&
+                               sim->frames % corrupt_every == 0;
+        }
+        if (sim->corrupt)
+                sim->corrupted++;
+
+        if (header)
+                *hdr = (struct cdev_spi_frame_hdr) {
+                        .magic = CDEV_SPI_HDR_MAGIC,
+                        .seq = cpu_to_le16(sim->seq),
+                        .len = cpu_to_le32(frame_size)
+                };
+
+        edge_ns = atomic64_xchg(&sim->edge_ns, 0);
+        if (edge_ns)
+                spi_sim_hist_add(&sim->hist_edge, ktime_get_ns() - edge_ns);
+}
+
+/**
+ * @brief Clock one transfer. Runs in the SPI message pump, may sleep
+ */
+static int spi_sim_transfer_one(struct spi_controller *ctlr,
+                                struct spi_device *spi,
+                                struct spi_transfer *xfer) {
+        size_t n;
+        size_t done = 0;
+        size_t bad = header ? sizeof(struct cdev_spi_frame_hdr) : 0;
+        u8 *rx = xfer->rx_buf;
+        struct spi_sim_dev *sim = &spi_sim->dev[spi_get_chipselect(spi, 0)];
+
+        while (done < xfer->len) {
+                if (sim->pos == 0)
+                        spi_sim_frame_start(sim, xfer);
+                n = min(xfer->len - done, sim->frame_len - sim->pos);
+                if (rx) {
+                        memcpy(rx + done, sim->frame + sim->pos, n);
+                        /* Flip the first payload byte */
+                        if (sim->corrupt && sim->pos <= bad &&
+                            bad < sim->pos + n)
+                                rx[done + bad - sim->pos] ^= 0xff;
+                }
+                done += n;
+                sim->pos = (sim->pos + n) % sim->frame_len;
+        }
+        if (rx)
+                spi_sim_swab_words(rx, xfer->len, xfer->bits_per_word);
+
+        /* Dual and quad receive clock 2 or 4 bits per cycle */
+        if (READ_ONCE(wire_time) && xfer->speed_hz)
+                fsleep(div_u64((u64) xfer->len * 8 * USEC_PER_SEC,
+                               xfer->speed_hz * max_t(u32, xfer->rx_nbits, 1)));
+        return 0;
+}
+
+/**
+ * @brief Chip select. level is the line level, asserted is low by default
+ */
+static void spi_sim_set_cs(struct spi_device *spi, bool level) {
+        struct spi_sim_dev *sim = &spi_sim->dev[spi_get_chipselect(spi, 0)];
+
+        if (level == !!(spi->mode & SPI_CS_HIGH))
+                return;
+        if (sim->pos) {
+                sim->resyncs++;
+                sim->pos = 0;
+        }
+}
+
+/*
+ * Debugfs, /sys/kernel/debug/spi_sim/
+ *   stats  per device counters and the READY edge to frame start histogram
+ *   edge   spi-sim-gen writes "<cs> <CLOCK_MONOTONIC ns>" before each edge
+ */
+static void spi_sim_hist_show(struct seq_file *s,
+                              const struct spi_sim_hist *hist) {
+        int n;
+        unsigned long total = 0;
+        unsigned long bucket[SPI_SIM_HIST_BUCKETS];
+
+        for (n = 0; n < SPI_SIM_HIST_BUCKETS; n++) {
+                bucket[n] = READ_ONCE(hist->bucket[n]);
+                total += bucket[n];
+        }
+
+        seq_printf(s, "  edge_to_start: %lu\n", total);
+        for (n = 0; n < SPI_SIM_HIST_BUCKETS; n++) {
+                if (!bucket[n])
+                        continue;
+                seq_printf(s, "    <  %10llu ns: %lu\n", 1ULL << n, bucket[n]);
+        }
+}
+
+static int spi_sim_stats_show(struct seq_file *s, void *unused) {
+        unsigned int cs;
+        struct spi_sim_dev *sim;
+
+        for (cs = 0; cs < devices; cs++) {
+                sim = &spi_sim->dev[cs];
+                seq_printf(s, "cs%u: frames %lu corrupted %lu retransmits %lu "
+                           "resyncs %lu\n", cs, READ_ONCE(sim->frames),
+                           READ_ONCE(sim->corrupted),
+                           READ_ONCE(sim->retransmits),
+                           READ_ONCE(sim->resyncs));
+                spi_sim_hist_show(s, &sim->hist_edge);
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(spi_sim_stats);
+
+static ssize_t spi_sim_edge_write(struct file *file, const char __user *ubuf,
+                                  size_t count, loff_t *ppos) {
+        char buf[32];
+        unsigned int cs;
+        unsigned long long ns;
+        ssize_t len;
+
+        len = simple_write_to_buffer(buf, sizeof(buf) - 1, ppos, ubuf, count);
+        if (len < 0)
+                return len;
+        buf[len] = '\0';
+        *ppos = 0;
+
+        if (sscanf(buf, "%u %llu", &cs, &ns) != 2 || cs >= devices)
+                return -EINVAL;
+        atomic64_set(&spi_sim->dev[cs].edge_ns, ns);
+        return count;
+}
+
+static const struct file_operations spi_sim_edge_fops = {
+        .owner = THIS_MODULE,
+        .write = spi_sim_edge_write,
+};
+
+/**
+ * @brief Map BUSY and READY of chip select cs to the gpio-sim lines
+ *
+ * The drivers ask for "mycomp,busy" and "mycomp,ready", which the device
+ * tree overlay provides on the Pi. Here a lookup table keyed by the SPI
+ * device name does the same.
+ */
+static int spi_sim_lookup_add(unsigned int cs) {
+        struct gpiod_lookup_table *lookup;
+
+        lookup = kzalloc(struct_size(lookup, table, 3), GFP_KERNEL);
+        if (!lookup)
+                return -ENOMEM;
+        lookup->dev_id = kasprintf(GFP_KERNEL, "spi%d.%u",
+                                   spi_sim->ctlr->bus_num, cs);
+        if (!lookup->dev_id) {
+                kfree(lookup);
+                return -ENOMEM;
+        }
+        lookup->table[0] = (struct gpiod_lookup)
+                GPIO_LOOKUP(gpio_chip, 0, "mycomp,busy", GPIO_ACTIVE_HIGH);
+        lookup->table[1] = (struct gpiod_lookup)
+                GPIO_LOOKUP(gpio_chip, 1 + cs, "mycomp,ready", GPIO_ACTIVE_HIGH);
+
+        gpiod_add_lookup_table(lookup);
+        spi_sim->lookup[cs] = lookup;
+        return 0;
+}
+
+static void spi_sim_lookup_del(unsigned int cs) {
+        struct gpiod_lookup_table *lookup = spi_sim->lookup[cs];
+
+        if (!lookup)
+                return;
+        gpiod_remove_lookup_table(lookup);
+        kfree(lookup->dev_id);
+        kfree(lookup);
+}
+
+static void spi_sim_free(void) {
+        unsigned int cs;
+
+        for (cs = 0; cs < devices; cs++) {
+                spi_sim_lookup_del(cs);
+                vfree(spi_sim->dev[cs].frame);
+        }
+        platform_device_unregister(spi_sim->pdev);
+        kfree(spi_sim);
+}
+
+static int __init spi_module_init(void)
+{
+        int retval;
+        unsigned int cs;
+        struct spi_controller *ctlr;
+        struct spi_board_info info = {
+                .max_speed_hz = max_speed_hz,
+                .mode = SPI_MODE_0
+        };
+
+        pr_info("%s: module init\n", SPI_SIM_MODULE);
+
+        if (!devices || devices > SPI_SIM_MAX_DEVICES) {
+                pr_err("%s: devices must be 1 to %d\n", SPI_SIM_MODULE,
+                       SPI_SIM_MAX_DEVICES);
+                return -EINVAL;
+        }
+        if (rx_bus_width != 1 && rx_bus_width != 2 && rx_bus_width != 4) {
+                pr_err("%s: rx_bus_width must be 1, 2 or 4\n", SPI_SIM_MODULE);
+                return -EINVAL;
+        }
+        if (rx_bus_width == 2)
+                info.mode |= SPI_RX_DUAL;
+        if (rx_bus_width == 4)
+                info.mode |= SPI_RX_QUAD;
+        if (!frame_size || frame_size > SPI_SIM_MAX_FRAME_SIZE) {
+                pr_err("%s: frame_size must be 1 to %d\n", SPI_SIM_MODULE,
+                       SPI_SIM_MAX_FRAME_SIZE);
+                return -EINVAL;
+        }
+
+        spi_sim = kzalloc(sizeof(*spi_sim), GFP_KERNEL);
+        if (!spi_sim)
+                return -ENOMEM;
+        for (cs = 0; cs < devices; cs++) {
+                retval = spi_sim_dev_init(&spi_sim->dev[cs]);
+                if (retval)
+                        goto err_free;
+        }
+
+        spi_sim->pdev = platform_device_register_simple(SPI_SIM_MODULE, -1,
+                                                        NULL, 0);
+        if (IS_ERR(spi_sim->pdev)) {
+                retval = PTR_ERR(spi_sim->pdev);
+                spi_sim->pdev = NULL;
+                goto err_free;
+        }
+
+        ctlr = spi_alloc_host(&spi_sim->pdev->dev, 0);
+        if (!ctlr) {
+                retval = -ENOMEM;
+                goto err_free;
+        }
+        ctlr->bus_num = -1;
+        ctlr->num_chipselect = devices;
+        ctlr->mode_bits = SPI_CPOL | SPI_CPHA | SPI_CS_HIGH | SPI_RX_DUAL |
+                          SPI_RX_QUAD;
+        ctlr->bits_per_word_mask = SPI_BPW_MASK(8) | SPI_BPW_MASK(16) |
+                                   SPI_BPW_MASK(32);
+        ctlr->max_speed_hz = max_speed_hz;
+        ctlr->transfer_one = spi_sim_transfer_one;
+        ctlr->set_cs = spi_sim_set_cs;
+
+        retval = spi_register_controller(ctlr);
+        if (retval) {
+                spi_controller_put(ctlr);
+                goto err_free;
+        }
+        spi_sim->ctlr = ctlr;
+
+        spi_sim->debugfs = debugfs_create_dir("spi_sim", NULL);
+        debugfs_create_file("stats", 0444, spi_sim->debugfs, NULL,
+                            &spi_sim_stats_fops);
+        debugfs_create_file("edge", 0200, spi_sim->debugfs, NULL,
+                            &spi_sim_edge_fops);
+
+        /* Lookup tables first, the driver may probe in spi_new_device() */
+        strscpy(info.modalias, modalias, sizeof(info.modalias));
+        for (cs = 0; cs < devices; cs++) {
+                retval = spi_sim_lookup_add(cs);
+                if (retval)
+                        goto err_ctlr;
+                info.chip_select = cs;
+                if (!spi_new_device(ctlr, &info)) {
+                        retval = -ENODEV;
+                        goto err_ctlr;
+                }
+        }
+
+        pr_info("%s: %u x %s on spi%d, gpio chip %s\n", SPI_SIM_MODULE,
+                devices, modalias, ctlr->bus_num, gpio_chip);
+        return 0;
+
+err_ctlr:
+        debugfs_remove_recursive(spi_sim->debugfs);
+        spi_unregister_controller(ctlr);
+err_free:
+        spi_sim_free();
+        return retval;
+}
+
+static void __exit spi_module_exit(void)
+{
+        /* Removes the devices, so the drivers let go of them first */
+        debugfs_remove_recursive(spi_sim->debugfs);
+        spi_unregister_controller(spi_sim->ctlr);
+        spi_sim_free();
+        pr_info("%s: module exit\n", SPI_SIM_MODULE);
+}
+
+module_init(spi_module_init);
+module_exit(spi_module_exit);
+
+MODULE_AUTHOR("Niels Prösch, <niels.h.prosch@gmail.com>");
+MODULE_LICENSE("GPL");